@@ -0,0 +1,71 @@
+/* 静态资源包格式
+ * 由htpack把一个目录（如htdocs/）打包成单个文件，httpd启动时mmap
+ * 该文件，请求命中时一次哈希查找后直接用writev发送。
+ *
+ * 文件布局（整数均为本机字节序，只在同一架构上使用）：
+ *   struct bundle_header
+ *   uint32_t buckets[nbuckets]      每个桶中第一个表项的下标+1，0表示空桶
+ *   struct bundle_entry entries[nentries]
+ *   数据区：URL路径、预先生成的响应头、文件内容
+ *
+ * 预先生成的响应头从状态行开始，不含Date、Connection和结尾的空行，
+ * 这几项由服务器在发送时补上。
+ */
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define BUNDLE_MAGIC "HTPK"
+#define BUNDLE_VERSION 1
+
+// 同一资源的不同编码，下标即为variants[]中的位置
+enum {
+    BUNDLE_IDENTITY = 0,
+    BUNDLE_GZIP,
+    BUNDLE_BR,
+    BUNDLE_NVARIANTS
+};
+
+struct bundle_header {
+    char magic[4];
+    uint32_t version;
+    uint32_t nentries;
+    uint32_t nbuckets;          // 2的幂
+    uint64_t buckets_off;
+    uint64_t entries_off;
+};
+
+struct bundle_variant {
+    uint64_t headers_off;
+    uint64_t body_off;
+    uint64_t body_len;
+    uint32_t headers_len;       // 0表示没有这个编码的版本
+    uint32_t reserved;
+    char etag[32];              // 带引号的ETag，各编码互不相同
+};
+
+struct bundle_entry {
+    uint32_t hash;
+    uint32_t next;              // 同一桶中下一个表项的下标+1，0表示结束
+    uint64_t path_off;          // URL路径，例如"/index.html"，不以'\0'结尾
+    uint32_t path_len;
+    uint32_t reserved;
+    struct bundle_variant variants[BUNDLE_NVARIANTS];
+};
+
+/* URL路径的哈希（FNV-1a），打包工具和服务器必须使用同一个函数 */
+static inline uint32_t bundle_hash(const char *s, size_t n)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+#endif /* BUNDLE_H */
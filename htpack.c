@@ -0,0 +1,343 @@
+/* 静态资源打包工具
+ * 用法：htpack <目录> <输出文件>
+ * 把目录下的所有静态文件打包成一个资源包（格式见bundle.h），供httpd
+ * 通过配置项bundle在启动时mmap后直接提供服务。
+ *  - 有执行权限的文件被视为CGI脚本，不打包
+ *  - 文件旁边的.gz/.br同名文件作为预压缩版本一起打包；没有.gz文件
+ *    的文本类资源会用zlib压缩一份，压缩后更小时才保留
+ *  - 每个版本的响应头（Content-Type、Content-Length、ETag、
+ *    Cache-Control等）都在打包时生成好
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "bundle.h"
+
+#define SERVER_STRING "Server: jdbhttpd/0.1.0\r\n"
+
+struct pack_file {
+    char *url;
+    const char *mime;
+    char *data[BUNDLE_NVARIANTS];
+    size_t len[BUNDLE_NVARIANTS];
+};
+
+static struct pack_file *files = NULL;
+static size_t nfiles = 0, files_cap = 0;
+
+// 数据区，最终接在表项数组后面写出
+static char *blob = NULL;
+static size_t blob_len = 0, blob_cap = 0;
+
+static void die(const char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/**********************************************************************/
+/* 根据文件扩展名确定Content-Type，与httpd.c中的get_content_type()
+ * 保持一致 */
+/**********************************************************************/
+static const char *mime_type(const char *filename)
+{
+    const char *dot = strrchr(filename, '.');
+    if (!dot) return "text/plain";
+
+    if (strcasecmp(dot, ".html") == 0 || strcasecmp(dot, ".htm") == 0)
+        return "text/html";
+    if (strcasecmp(dot, ".jpg") == 0 || strcasecmp(dot, ".jpeg") == 0)
+        return "image/jpeg";
+    if (strcasecmp(dot, ".gif") == 0)
+        return "image/gif";
+    if (strcasecmp(dot, ".png") == 0)
+        return "image/png";
+    if (strcasecmp(dot, ".css") == 0)
+        return "text/css";
+    if (strcasecmp(dot, ".js") == 0)
+        return "application/javascript";
+    if (strcasecmp(dot, ".json") == 0)
+        return "application/json";
+    if (strcasecmp(dot, ".svg") == 0)
+        return "image/svg+xml";
+    if (strcasecmp(dot, ".pdf") == 0)
+        return "application/pdf";
+
+    return "text/plain";
+}
+
+/**********************************************************************/
+/* 读取整个文件，文件不存在时返回NULL */
+/**********************************************************************/
+static char *read_file(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    struct stat st;
+    char *data;
+
+    if (fp == NULL)
+        return NULL;
+    if (fstat(fileno(fp), &st) == -1)
+        die(path);
+    data = malloc(st.st_size ? st.st_size : 1);
+    if (data == NULL)
+        die("malloc");
+    if (fread(data, 1, st.st_size, fp) != (size_t)st.st_size)
+        die(path);
+    fclose(fp);
+    *len = st.st_size;
+    return data;
+}
+
+/**********************************************************************/
+/* 用gzip格式压缩一段数据，压缩后没有变小时返回NULL */
+/**********************************************************************/
+static char *gzip_buffer(const char *data, size_t len, size_t *out_len)
+{
+    z_stream zs;
+    size_t cap = deflateBound(NULL, len) + 32;
+    char *out = malloc(cap);
+
+    if (out == NULL)
+        die("malloc");
+    memset(&zs, 0, sizeof(zs));
+    // windowBits为15+16时输出gzip格式
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        die("deflateInit2");
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = cap;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+        die("deflate");
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (*out_len >= len) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+static int compressible(const char *mime)
+{
+    return strncmp(mime, "text/", 5) == 0 ||
+           strcmp(mime, "application/javascript") == 0 ||
+           strcmp(mime, "application/json") == 0 ||
+           strcmp(mime, "image/svg+xml") == 0;
+}
+
+static int has_suffix(const char *s, const char *suffix)
+{
+    size_t n = strlen(s), m = strlen(suffix);
+    return n >= m && strcmp(s + n - m, suffix) == 0;
+}
+
+/**********************************************************************/
+/* 向数据区追加内容
+ * Returns: 数据在数据区中的偏移 */
+/**********************************************************************/
+static size_t blob_append(const void *data, size_t len)
+{
+    size_t off = blob_len;
+
+    if (blob_len + len > blob_cap) {
+        blob_cap = (blob_len + len) * 2;
+        blob = realloc(blob, blob_cap);
+        if (blob == NULL)
+            die("realloc");
+    }
+    memcpy(blob + blob_len, data, len);
+    blob_len += len;
+    return off;
+}
+
+/**********************************************************************/
+/* 添加一个文件以及它旁边的预压缩版本 */
+/**********************************************************************/
+static void add_file(const char *path, const char *url)
+{
+    struct pack_file *f;
+    char side[4096];
+
+    if (nfiles == files_cap) {
+        files_cap = files_cap ? files_cap * 2 : 64;
+        files = realloc(files, files_cap * sizeof(*files));
+        if (files == NULL)
+            die("realloc");
+    }
+    f = &files[nfiles++];
+    memset(f, 0, sizeof(*f));
+    if ((f->url = strdup(url)) == NULL)
+        die("strdup");
+    f->mime = mime_type(path);
+    f->data[BUNDLE_IDENTITY] = read_file(path, &f->len[BUNDLE_IDENTITY]);
+    if (f->data[BUNDLE_IDENTITY] == NULL)
+        die(path);
+
+    snprintf(side, sizeof(side), "%s.gz", path);
+    f->data[BUNDLE_GZIP] = read_file(side, &f->len[BUNDLE_GZIP]);
+    if (f->data[BUNDLE_GZIP] == NULL && compressible(f->mime))
+        f->data[BUNDLE_GZIP] = gzip_buffer(f->data[BUNDLE_IDENTITY],
+                f->len[BUNDLE_IDENTITY], &f->len[BUNDLE_GZIP]);
+    snprintf(side, sizeof(side), "%s.br", path);
+    f->data[BUNDLE_BR] = read_file(side, &f->len[BUNDLE_BR]);
+}
+
+/**********************************************************************/
+/* 递归遍历目录，url为该目录对应的URL前缀（以'/'结尾） */
+/**********************************************************************/
+static void walk(const char *dir, const char *url)
+{
+    DIR *d = opendir(dir);
+    struct dirent *de;
+    struct stat st;
+    char path[4096], sub_url[4096], base[4096];
+
+    if (d == NULL)
+        die(dir);
+    while ((de = readdir(d)) != NULL) {
+        if (de->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        snprintf(sub_url, sizeof(sub_url), "%s%s", url, de->d_name);
+        if (stat(path, &st) == -1)
+            die(path);
+        if (S_ISDIR(st.st_mode)) {
+            strncat(sub_url, "/", sizeof(sub_url) - strlen(sub_url) - 1);
+            walk(path, sub_url);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+            continue;
+        // 原文件存在的.gz/.br是它的预压缩版本，在add_file()中处理
+        if (has_suffix(path, ".gz") || has_suffix(path, ".br")) {
+            snprintf(base, sizeof(base), "%.*s", (int)strlen(path) - 3, path);
+            if (stat(base, &st) == 0)
+                continue;
+        }
+        add_file(path, sub_url);
+    }
+    closedir(d);
+}
+
+/**********************************************************************/
+/* 生成一个版本的ETag和响应头，并把响应头和内容写入数据区 */
+/**********************************************************************/
+static void pack_variant(const struct pack_file *f, int v, int vary,
+        struct bundle_variant *out, size_t data_start)
+{
+    static const char *suffix[BUNDLE_NVARIANTS] = { "", "-gz", "-br" };
+    static const char *encoding[BUNDLE_NVARIANTS] = { NULL, "gzip", "br" };
+    char hdr[1024];
+    uint64_t h = 14695981039346656037ull;
+    size_t i;
+    int n;
+
+    // ETag取原始内容的64位FNV-1a哈希，不同编码加上不同后缀
+    for (i = 0; i < f->len[BUNDLE_IDENTITY]; i++) {
+        h ^= (unsigned char)f->data[BUNDLE_IDENTITY][i];
+        h *= 1099511628211ull;
+    }
+    snprintf(out->etag, sizeof(out->etag), "\"%016llx%s\"",
+             (unsigned long long)h, suffix[v]);
+
+    n = snprintf(hdr, sizeof(hdr),
+                 "HTTP/1.1 200 OK\r\n"
+                 SERVER_STRING
+                 "Content-Type: %s\r\n"
+                 "Content-Length: %llu\r\n"
+                 "ETag: %s\r\n"
+                 "Cache-Control: %s\r\n"
+                 "%s%s%s%s",
+                 f->mime,
+                 (unsigned long long)f->len[v],
+                 out->etag,
+                 strcmp(f->mime, "text/html") == 0 ? "no-cache" : "public, max-age=3600",
+                 vary ? "Vary: Accept-Encoding\r\n" : "",
+                 encoding[v] ? "Content-Encoding: " : "",
+                 encoding[v] ? encoding[v] : "",
+                 encoding[v] ? "\r\n" : "");
+    out->headers_off = data_start + blob_append(hdr, n);
+    out->headers_len = n;
+    out->body_off = data_start + blob_append(f->data[v], f->len[v]);
+    out->body_len = f->len[v];
+}
+
+int main(int argc, char *argv[])
+{
+    struct bundle_header hdr;
+    struct bundle_entry *entries;
+    uint32_t *buckets;
+    size_t data_start, i;
+    char tmp[4096];
+    FILE *out;
+    int v, vary;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <directory> <output>\n", argv[0]);
+        return 1;
+    }
+    walk(argv[1], "/");
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, BUNDLE_MAGIC, 4);
+    hdr.version = BUNDLE_VERSION;
+    hdr.nentries = nfiles;
+    // 桶的数量取不小于表项数两倍的2的幂
+    for (hdr.nbuckets = 1; hdr.nbuckets < 2 * nfiles; hdr.nbuckets <<= 1)
+        ;
+    hdr.buckets_off = sizeof(hdr);
+    hdr.entries_off = hdr.buckets_off + hdr.nbuckets * sizeof(uint32_t);
+    hdr.entries_off = (hdr.entries_off + 7) & ~(uint64_t)7;
+    data_start = hdr.entries_off + nfiles * sizeof(struct bundle_entry);
+
+    buckets = calloc(hdr.nbuckets, sizeof(uint32_t));
+    entries = calloc(nfiles ? nfiles : 1, sizeof(struct bundle_entry));
+    if (buckets == NULL || entries == NULL)
+        die("calloc");
+
+    for (i = 0; i < nfiles; i++) {
+        struct pack_file *f = &files[i];
+        struct bundle_entry *e = &entries[i];
+        uint32_t b;
+
+        e->path_len = strlen(f->url);
+        e->path_off = data_start + blob_append(f->url, e->path_len);
+        e->hash = bundle_hash(f->url, e->path_len);
+        b = e->hash & (hdr.nbuckets - 1);
+        e->next = buckets[b];
+        buckets[b] = i + 1;
+
+        vary = f->data[BUNDLE_GZIP] != NULL || f->data[BUNDLE_BR] != NULL;
+        for (v = 0; v < BUNDLE_NVARIANTS; v++)
+            if (f->data[v] != NULL)
+                pack_variant(f, v, vary, &e->variants[v], data_start);
+    }
+
+    // 先写临时文件再rename，正在mmap旧资源包的服务器不会读到写了一半的文件
+    snprintf(tmp, sizeof(tmp), "%s.tmp", argv[2]);
+    out = fopen(tmp, "wb");
+    if (out == NULL)
+        die(tmp);
+    fwrite(&hdr, sizeof(hdr), 1, out);
+    fwrite(buckets, sizeof(uint32_t), hdr.nbuckets, out);
+    for (i = hdr.buckets_off + hdr.nbuckets * sizeof(uint32_t); i < hdr.entries_off; i++)
+        fputc(0, out);
+    fwrite(entries, sizeof(struct bundle_entry), nfiles, out);
+    fwrite(blob, 1, blob_len, out);
+    if (fclose(out) != 0)
+        die(tmp);
+    if (rename(tmp, argv[2]) == -1)
+        die(argv[2]);
+
+    printf("packed %zu files into %s (%zu bytes)\n", nfiles, argv[2],
+           data_start + blob_len);
+    return 0;
+}
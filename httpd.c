@@ -12,10 +12,14 @@
  *  4) Uncomment the line that runs accept_request().
  *  5) Remove -lsocket from the Makefile.
  */
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <ctype.h>
@@ -28,6 +32,29 @@
 #include <stdint.h>
 #include <time.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/time.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <zlib.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+/* USDT探针：安装了systemtap-sdt-dev时编译进真正的探针，否则为空操作 */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+#ifndef DTRACE_PROBE1
+#define DTRACE_PROBE1(provider, name, a1) do { (void)(a1); } while (0)
+#define DTRACE_PROBE2(provider, name, a1, a2) do { (void)(a1); (void)(a2); } while (0)
+#endif
+
+#include "bundle.h"
 
 #define ISspace(x) isspace((int)(x))
 
@@ -36,227 +63,1789 @@
 #define STDOUT  1
 #define STDERR  2
 
-// 在文件开头添加新的响应头定义
-#define CONTENT_LENGTH "Content-Length: %d\r\n"
-#define CONTENT_TYPE "Content-Type: %s\r\n"
-#define CONNECTION "Connection: %s\r\n"
-#define DATE "Date: %s\r\n"
+// 在文件开头添加新的响应头定义
+#define CONTENT_LENGTH "Content-Length: %lld\r\n"
+#define CONTENT_TYPE "Content-Type: %s\r\n"
+#define CONNECTION "Connection: %s\r\n"
+#define DATE "Date: %s\r\n"
+
+/*
+ * 这是一个简单的HTTP服务器实现
+ * 主要功能：
+ * 1. 处理基本的HTTP GET和POST请求
+ * 2. 支持静态文件服务
+ * 3. 支持CGI脚本执行
+ * 4. 多线程处理客户端请求
+ */
+
+struct connection;          // 连接对象，定义见下文
+
+void accept_request(void *); // 处理HTTP请求
+void bad_request(int);      // 发送400错误响应
+void header_too_large(int); // 发送431错误响应
+void cat(int, int);           // 发送文件内容
+void cannot_execute(int);   // 发送500错误响应
+void error_die(const char *); // 错误处理和退出
+void execute_cgi(struct connection *, const char *); // 执行CGI脚本
+int get_line(struct connection *, char *, int); // 读取一行HTTP请求
+void headers(int, const char *, off_t, const char *, int); // 发送HTTP响应头
+void not_found(int);        // 发送404错误响应
+void serve_file(struct connection *, const char *); // 处理静态文件请求
+int startup(u_short *);     // 启动服务器
+void unimplemented(int);    // 发送501错误响应
+void log_init(void);        // 打开访问日志
+void log_access(const char *format, ...); // 记录访问日志
+const char* get_content_type(const char *filename); // 添加这一行声明
+int process_request(struct connection *); // 解析并分发单个HTTP请求
+void service_unavailable(int); // 发送预先生成的503响应
+
+// 添加配置结构
+typedef struct {
+    int port;
+    char document_root[512];
+    int max_clients;
+    int timeout;
+    int queue_target_ms;    // CoDel排队延迟目标（毫秒），0表示关闭
+    int queue_interval_ms;  // 延迟持续超标多久后开始丢弃（毫秒）
+    int per_ip_max_conns;   // 单个IP的最大并发连接数，0表示不限制
+    int per_ip_rate;        // 单个IP每秒允许的新连接数（令牌桶速率），0表示不限制
+    int per_ip_burst;       // 令牌桶容量
+    int retry_after;        // 503响应中Retry-After的秒数
+    int trace_sample_rate;  // 每N个请求追踪1个，0表示关闭追踪
+    char trace_file[512];   // Chrome trace JSON输出文件
+    char bundle[512];       // htpack生成的静态资源包，为空表示不使用
+    long gzip_cache_size;   // 在线gzip压缩结果的缓存上限（字节），0表示不在线压缩
+    long gzip_max_size;     // 超过该大小的文件不在线压缩
+    int gzip_level;         // 在线压缩的级别（1-9）
+    long long large_file_size; // 不小于该大小的文件用sendfile分片发送
+    long sendfile_chunk;    // 大文件每次sendfile发送的字节数
+    int listen_backlog;     // listen()的连接队列长度
+    int tcp_defer_accept;   // 收到请求数据才唤醒accept的等待秒数（0表示关闭）
+    int tcp_fastopen;       // TCP Fast Open队列长度（0表示关闭）
+    int tcp_nodelay;        // 连接上是否设置TCP_NODELAY
+    int tcp_cork;           // 静态文件响应是否用TCP_CORK合并报文段
+} server_config;
+
+// 添加配置读取函数
+server_config read_config(const char *filename) 
+{
+    server_config config = {
+        .port = 4000,
+        .document_root = "htdocs",
+        .max_clients = 1000,
+        .timeout = 60,
+        .queue_target_ms = 20,
+        .queue_interval_ms = 200,
+        .per_ip_max_conns = 64,
+        .per_ip_rate = 100,
+        .per_ip_burst = 200,
+        .retry_after = 1,
+        .trace_sample_rate = 0,
+        .trace_file = "trace.json",
+        .bundle = "",
+        .gzip_cache_size = 8 * 1024 * 1024,
+        .gzip_max_size = 1024 * 1024,
+        .gzip_level = 6,
+        .large_file_size = 4 * 1024 * 1024,
+        .sendfile_chunk = 512 * 1024,
+        .listen_backlog = 128,
+        .tcp_defer_accept = 1,
+        .tcp_fastopen = 0,
+        .tcp_nodelay = 1,
+        .tcp_cork = 1
+    };
+    
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) return config;
+    
+    char line[1024];
+    char key[64], value[960];
+    
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '#' || line[0] == '\n') continue;
+        
+        if (sscanf(line, "%63[^=]=%959s", key, value) == 2) {
+            if (strcmp(key, "port") == 0)
+                config.port = atoi(value);
+            else if (strcmp(key, "document_root") == 0)
+                strncpy(config.document_root, value, sizeof(config.document_root)-1);
+            else if (strcmp(key, "max_clients") == 0)
+                config.max_clients = atoi(value);
+            else if (strcmp(key, "timeout") == 0)
+                config.timeout = atoi(value);
+            else if (strcmp(key, "queue_target_ms") == 0)
+                config.queue_target_ms = atoi(value);
+            else if (strcmp(key, "queue_interval_ms") == 0)
+                config.queue_interval_ms = atoi(value);
+            else if (strcmp(key, "per_ip_max_conns") == 0)
+                config.per_ip_max_conns = atoi(value);
+            else if (strcmp(key, "per_ip_rate") == 0)
+                config.per_ip_rate = atoi(value);
+            else if (strcmp(key, "per_ip_burst") == 0)
+                config.per_ip_burst = atoi(value);
+            else if (strcmp(key, "retry_after") == 0)
+                config.retry_after = atoi(value);
+            else if (strcmp(key, "trace_sample_rate") == 0)
+                config.trace_sample_rate = atoi(value);
+            else if (strcmp(key, "trace_file") == 0)
+                strncpy(config.trace_file, value, sizeof(config.trace_file)-1);
+            else if (strcmp(key, "bundle") == 0)
+                strncpy(config.bundle, value, sizeof(config.bundle)-1);
+            else if (strcmp(key, "gzip_cache_size") == 0)
+                config.gzip_cache_size = atol(value);
+            else if (strcmp(key, "gzip_max_size") == 0)
+                config.gzip_max_size = atol(value);
+            else if (strcmp(key, "gzip_level") == 0)
+                config.gzip_level = atoi(value);
+            else if (strcmp(key, "large_file_size") == 0)
+                config.large_file_size = atoll(value);
+            else if (strcmp(key, "sendfile_chunk") == 0)
+                config.sendfile_chunk = atol(value);
+            else if (strcmp(key, "listen_backlog") == 0)
+                config.listen_backlog = atoi(value);
+            else if (strcmp(key, "tcp_defer_accept") == 0)
+                config.tcp_defer_accept = atoi(value);
+            else if (strcmp(key, "tcp_fastopen") == 0)
+                config.tcp_fastopen = atoi(value);
+            else if (strcmp(key, "tcp_nodelay") == 0)
+                config.tcp_nodelay = atoi(value);
+            else if (strcmp(key, "tcp_cork") == 0)
+                config.tcp_cork = atoi(value);
+        }
+    }
+    
+    fclose(fp);
+    return config;
+}
+
+/**********************************************************************/
+/* 准入控制与过载保护
+ * 在main()的accept循环中对每个新连接做三项检查：
+ *  1. 全局并发连接数不超过max_clients
+ *  2. 单个客户端IP的并发连接数不超过per_ip_max_conns
+ *  3. 单个客户端IP的新建连接速率受令牌桶(per_ip_rate/per_ip_burst)限制
+ * 另外在accept循环中、创建线程之前测量连接在内核accept队列中的排队
+ * 延迟，按CoDel的思路：延迟持续interval以上都高于target时进入丢弃
+ * 状态，直到出现低于target的样本为止。
+ * 被拒绝的连接只会收到预先生成好的503响应，不会进入请求解析。 */
+/**********************************************************************/
+
+#define IP_TABLE_SIZE 1024  // 必须是2的幂
+#define IP_TABLE_PROBE 8    // 线性探测的最大步数
+
+// 单个客户端IP的限流状态
+struct ip_slot {
+    in_addr_t addr;
+    int active;             // 当前并发连接数
+    double tokens;          // 令牌桶剩余令牌
+    uint64_t last_refill;   // 上次补充令牌的时间（微秒）
+};
+
+static server_config config;
+static pthread_mutex_t admission_lock = PTHREAD_MUTEX_INITIALIZER;
+static int active_clients = 0;
+static struct ip_slot ip_table[IP_TABLE_SIZE];
+static uint64_t codel_first_above = 0;  // 延迟首次超标后的判定截止时间
+static int codel_dropping = 0;          // 是否处于丢弃状态
+static char unavailable_response[256];  // 预先生成的503响应
+static size_t unavailable_len = 0;
+
+/**********************************************************************/
+/* 返回单调时钟的当前时间（微秒） */
+/**********************************************************************/
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**********************************************************************/
+/* 根据配置生成503响应，只在启动时调用一次 */
+/**********************************************************************/
+static void admission_init(void)
+{
+    static const char body[] = "<HTML><TITLE>Service Unavailable</TITLE>"
+                               "<BODY><P>Server is busy, please retry.</BODY></HTML>\r\n";
+    int n;
+
+    n = snprintf(unavailable_response, sizeof(unavailable_response),
+                 "HTTP/1.1 503 Service Unavailable\r\n"
+                 SERVER_STRING
+                 "Retry-After: %d\r\n"
+                 "Content-Type: text/html\r\n"
+                 "Content-Length: %d\r\n"
+                 "Connection: close\r\n"
+                 "\r\n%s",
+                 config.retry_after, (int)(sizeof(body) - 1), body);
+    unavailable_len = (n > 0 && (size_t)n < sizeof(unavailable_response)) ? (size_t)n : 0;
+}
+
+#define FDS_PER_CLIENT 5    // 连接套接字加上文件和预压缩文件，或CGI的两对管道
+#define FD_RESERVE 32       // 监听套接字、追踪文件、标准输入输出等
+
+/**********************************************************************/
+/* 确保max_clients个连接不会耗尽文件描述符：软限制不够时先提高到
+ * 硬限制以内，仍然不够就降低max_clients，只在启动时调用一次 */
+/**********************************************************************/
+static void fd_limit_init(void)
+{
+    struct rlimit rl;
+    rlim_t need;
+
+    if (config.max_clients <= 0 || getrlimit(RLIMIT_NOFILE, &rl) == -1)
+        return;
+    need = (rlim_t)config.max_clients * FDS_PER_CLIENT + FD_RESERVE;
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < need) {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= need) ?
+                      need : rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1)
+            getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < need) {
+        config.max_clients = rl.rlim_cur > FD_RESERVE + FDS_PER_CLIENT ?
+                             (int)((rl.rlim_cur - FD_RESERVE) / FDS_PER_CLIENT) : 1;
+        fprintf(stderr, "max_clients lowered to %d to fit RLIMIT_NOFILE %llu\n",
+                config.max_clients, (unsigned long long)rl.rlim_cur);
+    }
+}
+
+/**********************************************************************/
+/* 查找（或占用）某个IP对应的限流表项，调用者须持有admission_lock。
+ * 表满时返回NULL，此时放弃按IP限流而不是拒绝连接。 */
+/**********************************************************************/
+static struct ip_slot *ip_slot_lookup(in_addr_t addr, uint64_t now)
+{
+    uint32_t h = (uint32_t)addr * 2654435761u;
+    struct ip_slot *victim = NULL;
+    int k;
+
+    for (k = 0; k < IP_TABLE_PROBE; k++) {
+        struct ip_slot *slot = &ip_table[(h + k) & (IP_TABLE_SIZE - 1)];
+        if (slot->last_refill != 0 && slot->addr == addr)
+            return slot;
+        // 空闲且令牌早已补满的表项可以被其他IP复用
+        if (victim == NULL && slot->active == 0 &&
+            (slot->last_refill == 0 || now - slot->last_refill > 10000000))
+            victim = slot;
+    }
+    if (victim != NULL) {
+        victim->addr = addr;
+        victim->active = 0;
+        victim->tokens = config.per_ip_burst;
+        victim->last_refill = now;
+    }
+    return victim;
+}
+
+/**********************************************************************/
+/* 决定是否接纳一个新连接。
+ * Parameters: 客户端地址、当前时间，以及用于返回被计数的限流表项的
+ *             指针（表满时没有按IP计数，返回NULL）
+ * Returns: 1 接纳（已计入并发计数，结束时须用*charged调用admission_release）
+ *          0 拒绝 */
+/**********************************************************************/
+static int admission_acquire(in_addr_t addr, uint64_t now, struct ip_slot **charged)
+{
+    struct ip_slot *slot;
+    int ok = 0;
+
+    *charged = NULL;
+    pthread_mutex_lock(&admission_lock);
+    if (config.max_clients > 0 && active_clients >= config.max_clients)
+        goto out;
+
+    slot = ip_slot_lookup(addr, now);
+    if (slot != NULL) {
+        if (config.per_ip_max_conns > 0 && slot->active >= config.per_ip_max_conns)
+            goto out;
+        if (config.per_ip_rate > 0) {
+            slot->tokens += (now - slot->last_refill) * config.per_ip_rate / 1e6;
+            if (slot->tokens > config.per_ip_burst)
+                slot->tokens = config.per_ip_burst;
+            slot->last_refill = now;
+            if (slot->tokens < 1.0)
+                goto out;
+            slot->tokens -= 1.0;
+        } else {
+            slot->last_refill = now;
+        }
+        slot->active++;
+        *charged = slot;    // active>0的表项不会被其他IP复用，指针一直有效
+    }
+    active_clients++;
+    ok = 1;
+out:
+    pthread_mutex_unlock(&admission_lock);
+    return ok;
+}
+
+/**********************************************************************/
+/* 连接结束时归还admission_acquire占用的计数，只归还当时实际计数的
+ * 表项：表满时被接纳的连接没有按IP计数，不能减掉同一IP之后占到的
+ * 表项的计数 */
+/**********************************************************************/
+static void admission_release(struct ip_slot *charged)
+{
+    pthread_mutex_lock(&admission_lock);
+    active_clients--;
+    if (charged != NULL)
+        charged->active--;
+    pthread_mutex_unlock(&admission_lock);
+}
+
+/**********************************************************************/
+/* 估算刚accept的连接在内核accept队列中等待的时间
+ * 用TCP_INFO中距离收到客户端最后一个数据包的时间：开启
+ * tcp_defer_accept时连接在请求数据到达后才进入accept队列，这就是
+ * 排队时间；否则它是排队时间的下限（精度为毫秒）。
+ * Returns: 微秒，取不到时为0 */
+/**********************************************************************/
+static uint64_t accept_queue_delay_us(int fd)
+{
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == -1)
+        return 0;
+    return (uint64_t)ti.tcpi_last_data_recv * 1000;
+}
+
+/**********************************************************************/
+/* CoDel判定：根据本次连接的排队延迟更新丢弃状态。
+ * Returns: 1 表示该连接应当被丢弃 */
+/**********************************************************************/
+static int codel_should_drop(uint64_t sojourn_us, uint64_t now)
+{
+    uint64_t target = (uint64_t)config.queue_target_ms * 1000;
+    int drop = 0;
+
+    if (config.queue_target_ms <= 0)
+        return 0;
+
+    pthread_mutex_lock(&admission_lock);
+    if (sojourn_us < target) {
+        codel_first_above = 0;
+        codel_dropping = 0;
+    } else if (codel_first_above == 0) {
+        codel_first_above = now + (uint64_t)config.queue_interval_ms * 1000;
+    } else if (now >= codel_first_above) {
+        codel_dropping = 1;
+    }
+    drop = codel_dropping;
+    pthread_mutex_unlock(&admission_lock);
+    return drop;
+}
+
+/**********************************************************************/
+/* 连接对象与请求内存池
+ * 每个连接对应一个struct connection，其中包含：
+ *  - 读缓冲区：get_line()从这里按行取数据，不再逐字节recv()；
+ *    同一连接上流水线发来的后续请求也保留在缓冲区中
+ *  - 一块bump arena：请求行、请求头和拼接出的文件路径都从这里分配，
+ *    每个请求结束后整体reset，供keep-alive的下一个请求复用
+ * 连接对象用完后放回空闲链表，预热之后处理请求不再调用malloc。 */
+/**********************************************************************/
+
+#define ARENA_SIZE 65536        // 每个连接的arena大小
+#define READ_BUF_SIZE 4096      // 每个连接的读缓冲区大小
+#define LINE_MAX_LEN 8192       // 请求行或单个请求头的最大长度
+#define ARENA_RESERVE (3 * LINE_MAX_LEN) // 请求头不能占用的部分，留给文件路径和CGI环境变量
+#define MAX_HEADERS 32          // 单个请求最多保存的请求头数量
+
+struct arena {
+    char *base;
+    size_t size;
+    size_t used;
+};
+
+// 解析后的请求头，name/value都指向arena中的字符串
+struct header {
+    const char *name;
+    const char *value;
+};
+
+// 单个HTTP请求解析后的状态，所有字符串都在连接的arena中
+struct request {
+    const char *method;
+    const char *url;            // 不含查询字符串
+    const char *version;
+    const char *query_string;   // 没有查询字符串时为NULL
+    char *path;                 // 对应的本地文件路径
+    struct header headers[MAX_HEADERS];
+    int num_headers;
+    long content_length;        // 没有Content-Length时为-1
+    int chunked;                // 请求体使用分块编码
+    int keep_alive;             // 响应结束后是否保持连接
+    int status;                 // 实际发送的响应码，用于访问日志
+};
+
+struct connection {
+    int fd;
+    in_addr_t addr;
+    struct ip_slot *ip_slot;    // admission_acquire计数的限流表项，可能为NULL
+    struct connection *next;    // 空闲链表
+    size_t rpos, rlen;          // 读缓冲区中尚未消费的数据范围
+    char rbuf[READ_BUF_SIZE];
+    char line[LINE_MAX_LEN];
+    struct request req;
+    struct arena arena;
+    char arena_buf[ARENA_SIZE];
+};
+
+/**********************************************************************/
+/* 请求追踪
+ * 按trace_sample_rate对请求抽样（每N个请求追踪1个，0表示关闭），
+ * 被抽中的请求在各个阶段（get_line、stat、realpath、open、cat、
+ * CGI子进程等）记录带时间戳的区间，先写入线程自己的缓冲区，请求
+ * 结束时一次性以Chrome trace JSON格式追加到trace_file中，可以直接
+ * 用chrome://tracing或Perfetto打开。
+ * 同样的位置还放置了USDT静态探针（provider为httpd），未挂载
+ * perf/bpftrace时探针只是一条nop，与是否抽样无关：
+ *   request__start(id)  request__done(id, status)
+ *   phase__start(id, name)  phase__done(id, name) */
+/**********************************************************************/
+
+#define TRACE_MAX_SPANS 32      // 单个请求最多记录的阶段数
+
+struct trace_span {
+    const char *name;
+    uint64_t start_us;
+    uint64_t dur_us;
+};
+
+static FILE *trace_fp = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long trace_seq = 0;     // 请求编号计数器
+
+// 每个线程自己的追踪缓冲区，只记录当前请求
+static __thread struct trace_span trace_spans[TRACE_MAX_SPANS];
+static __thread int trace_nspans;
+static __thread int trace_sampled;
+static __thread unsigned long trace_id;
+static __thread uint64_t trace_req_start;
+
+/**********************************************************************/
+/* 打开追踪输出文件，只在启动时调用一次 */
+/**********************************************************************/
+static void trace_init(void)
+{
+    if (config.trace_sample_rate <= 0)
+        return;
+    // 与访问日志和套接字一样带O_CLOEXEC，不泄漏给CGI子进程
+    trace_fp = fopen(config.trace_file, "we");
+    if (trace_fp == NULL) {
+        perror("trace_file");
+        return;
+    }
+    // JSON数组格式允许省略结尾的']'，进程被直接杀掉时文件依然可用
+    fprintf(trace_fp, "[\n");
+    fflush(trace_fp);
+}
+
+/**********************************************************************/
+/* 一个新请求开始（已读到请求行），决定是否对它抽样 */
+/**********************************************************************/
+static void trace_request_begin(void)
+{
+    trace_id = __atomic_add_fetch(&trace_seq, 1, __ATOMIC_RELAXED);
+    trace_sampled = trace_fp != NULL && trace_id % config.trace_sample_rate == 0;
+    trace_nspans = 0;
+    trace_req_start = trace_sampled ? monotonic_us() : 0;
+    DTRACE_PROBE1(httpd, request__start, trace_id);
+    // get_line阶段从这里开始，由process_request()中的trace_end()结束
+    DTRACE_PROBE2(httpd, phase__start, trace_id, "get_line");
+}
+
+/**********************************************************************/
+/* 标记一个阶段开始
+ * Returns: 开始时间，未抽样时为0，作为参数传给trace_end() */
+/**********************************************************************/
+static uint64_t trace_begin(const char *name)
+{
+    DTRACE_PROBE2(httpd, phase__start, trace_id, name);
+    return trace_sampled ? monotonic_us() : 0;
+}
+
+/**********************************************************************/
+/* 标记一个阶段结束，抽样的请求把该区间记入线程缓冲区 */
+/**********************************************************************/
+static void trace_end(const char *name, uint64_t start)
+{
+    struct trace_span *span;
+
+    DTRACE_PROBE2(httpd, phase__done, trace_id, name);
+    if (start == 0 || trace_nspans == TRACE_MAX_SPANS)
+        return;
+    span = &trace_spans[trace_nspans++];
+    span->name = name;
+    span->start_us = start;
+    span->dur_us = monotonic_us() - start;
+}
+
+/**********************************************************************/
+/* 以JSON字符串的形式输出s，转义引号、反斜杠和控制字符 */
+/**********************************************************************/
+static void trace_json_string(FILE *fp, const char *s)
+{
+    fputc('"', fp);
+    for (; s != NULL && *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(fp, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(fp, "\\u%04x", (unsigned char)*s);
+        else
+            fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+/**********************************************************************/
+/* 请求结束：把线程缓冲区中的区间写入追踪文件
+ * Parameters: the request that just finished */
+/**********************************************************************/
+static void trace_request_end(const struct request *req)
+{
+    long tid;
+    int pid, k;
+
+    DTRACE_PROBE2(httpd, request__done, trace_id, req->status);
+    if (!trace_sampled)
+        return;
+    trace_sampled = 0;
+
+    tid = (long)syscall(SYS_gettid);
+    pid = (int)getpid();
+    pthread_mutex_lock(&trace_lock);
+    fprintf(trace_fp, "{\"name\":\"request\",\"cat\":\"httpd\",\"ph\":\"X\","
+            "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%ld,"
+            "\"args\":{\"id\":%lu,\"method\":",
+            (unsigned long long)trace_req_start,
+            (unsigned long long)(monotonic_us() - trace_req_start),
+            pid, tid, trace_id);
+    trace_json_string(trace_fp, req->method);
+    fprintf(trace_fp, ",\"url\":");
+    trace_json_string(trace_fp, req->url);
+    fprintf(trace_fp, ",\"status\":%d}},\n", req->status);
+    for (k = 0; k < trace_nspans; k++)
+        fprintf(trace_fp, "{\"name\":\"%s\",\"cat\":\"httpd\",\"ph\":\"X\","
+                "\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%ld},\n",
+                trace_spans[k].name,
+                (unsigned long long)trace_spans[k].start_us,
+                (unsigned long long)trace_spans[k].dur_us,
+                pid, tid);
+    fflush(trace_fp);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+static pthread_mutex_t conn_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct connection *conn_free_list = NULL;
+static char docroot_real[PATH_MAX];     // document_root的绝对路径，启动时解析一次
+
+/**********************************************************************/
+/* 从arena中分配n字节（8字节对齐），空间不足时返回NULL */
+/**********************************************************************/
+static void *arena_alloc(struct arena *a, size_t n)
+{
+    void *p;
+
+    n = (n + 7) & ~(size_t)7;
+    if (n > a->size - a->used)
+        return NULL;
+    p = a->base + a->used;
+    a->used += n;
+    return p;
+}
+
+/**********************************************************************/
+/* 把长度为n的字符串复制到arena中并以'\0'结尾 */
+/**********************************************************************/
+static char *arena_strndup(struct arena *a, const char *s, size_t n)
+{
+    char *p = arena_alloc(a, n + 1);
+
+    if (p == NULL)
+        return NULL;
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+static void arena_reset(struct arena *a)
+{
+    a->used = 0;
+}
+
+/**********************************************************************/
+/* 取一个空闲的连接对象，空闲链表为空时才向系统申请 */
+/**********************************************************************/
+static struct connection *conn_get(void)
+{
+    struct connection *conn;
+
+    pthread_mutex_lock(&conn_pool_lock);
+    conn = conn_free_list;
+    if (conn != NULL)
+        conn_free_list = conn->next;
+    pthread_mutex_unlock(&conn_pool_lock);
+
+    if (conn == NULL && (conn = malloc(sizeof(*conn))) == NULL)
+        return NULL;
+    conn->next = NULL;
+    conn->rpos = conn->rlen = 0;
+    conn->arena.base = conn->arena_buf;
+    conn->arena.size = sizeof(conn->arena_buf);
+    conn->arena.used = 0;
+    return conn;
+}
+
+/**********************************************************************/
+/* 把连接对象放回空闲链表 */
+/**********************************************************************/
+static void conn_put(struct connection *conn)
+{
+    pthread_mutex_lock(&conn_pool_lock);
+    conn->next = conn_free_list;
+    conn_free_list = conn;
+    pthread_mutex_unlock(&conn_pool_lock);
+}
+
+#define LINGER_MS 200              // 关闭连接前等待剩余请求数据的时间
+#define LINGER_MAX_BYTES (256 * 1024)   // 关闭连接前最多读掉的字节数
+
+/**********************************************************************/
+/* 关闭连接。还有未读的请求数据时直接close()会让内核回RST，客户端
+ * 可能收不到刚发出的错误响应（例如431），因此先关闭写端，再在有限
+ * 的时间内读掉剩余数据 */
+/**********************************************************************/
+static void conn_close(struct connection *conn)
+{
+    char drain[4096];
+    struct pollfd pfd;
+    size_t total = 0;
+    ssize_t n;
+
+    if (conn->rpos < conn->rlen ||
+        recv(conn->fd, drain, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+        shutdown(conn->fd, SHUT_WR);
+        pfd.fd = conn->fd;
+        pfd.events = POLLIN;
+        while (total < LINGER_MAX_BYTES && poll(&pfd, 1, LINGER_MS) > 0) {
+            n = recv(conn->fd, drain, sizeof(drain), 0);
+            if (n <= 0)
+                break;
+            total += n;
+        }
+    }
+    close(conn->fd);
+}
+
+/**********************************************************************/
+/* 读缓冲区为空时从套接字补充数据
+ * Returns: 1 成功，0 对端关闭、出错或超时 */
+/**********************************************************************/
+static int conn_fill(struct connection *conn)
+{
+    ssize_t n = recv(conn->fd, conn->rbuf, sizeof(conn->rbuf), 0);
+
+    if (n <= 0)
+        return 0;
+    conn->rpos = 0;
+    conn->rlen = (size_t)n;
+    return 1;
+}
+
+/**********************************************************************/
+/* 读取请求体：先消费读缓冲区中剩余的数据，再直接从套接字读取 */
+/**********************************************************************/
+static ssize_t conn_read(struct connection *conn, void *buf, size_t n)
+{
+    size_t avail = conn->rlen - conn->rpos;
+
+    if (avail == 0)
+        return recv(conn->fd, buf, n, 0);
+    if (n > avail)
+        n = avail;
+    memcpy(buf, conn->rbuf + conn->rpos, n);
+    conn->rpos += n;
+    return (ssize_t)n;
+}
+
+/**********************************************************************/
+/* 在请求头表中按名字（不区分大小写）查找请求头
+ * Returns: 请求头的值，不存在时返回NULL */
+/**********************************************************************/
+static const char *request_header(const struct request *req, const char *name)
+{
+    int k;
+
+    for (k = 0; k < req->num_headers; k++)
+        if (strcasecmp(req->headers[k].name, name) == 0)
+            return req->headers[k].value;
+    return NULL;
+}
+
+/**********************************************************************/
+/* Read the request line and the headers of the next request on the
+ * connection into conn->req.  Every string is copied into the
+ * connection's arena.
+ * Returns: 0 on success, -1 if the client closed the connection or
+ *          timed out, otherwise the HTTP status code to reply with */
+/**********************************************************************/
+static int parse_request(struct connection *conn)
+{
+    struct request *req = &conn->req;
+    struct arena *a = &conn->arena;
+    char *line = conn->line;
+    const char *connection = NULL;
+    char *p, *q, *end;
+    size_t name_len;
+    int bad_encoding = 0;
+    int n;
+
+    req->method = req->url = req->version = req->query_string = NULL;
+    req->path = NULL;
+    req->num_headers = 0;
+    req->content_length = -1;
+    req->chunked = 0;
+    req->keep_alive = 0;
+    req->status = 0;
+
+    // 跳过请求之间多余的空行
+    do {
+        n = get_line(conn, line, sizeof(conn->line));
+        if (n == 0)
+            return -1;
+    } while (strcmp(line, "\n") == 0);
+    // 从读到请求行开始计时，keep-alive连接上的空闲等待不计入
+    trace_request_begin();
+    if (line[n - 1] != '\n')
+        return 400;     // 请求行过长
+
+    // 请求行：方法 URL 版本
+    p = line;
+    for (q = p; *p && !ISspace(*p); p++)
+        ;
+    req->method = arena_strndup(a, q, p - q);
+    while (*p == ' ' || *p == '\t')
+        p++;
+    for (q = p; *p && !ISspace(*p); p++)
+        ;
+    req->url = arena_strndup(a, q, p - q);
+    while (*p == ' ' || *p == '\t')
+        p++;
+    for (q = p; *p && !ISspace(*p); p++)
+        ;
+    req->version = arena_strndup(a, q, p - q);
+    if (req->method == NULL || req->url == NULL || req->version == NULL ||
+        req->url[0] == '\0')
+        return 400;
+
+    // 请求头：逐行读取直到空行
+    while (1) {
+        n = get_line(conn, line, sizeof(conn->line));
+        if (n == 0)
+            return -1;
+        if (line[n - 1] != '\n')
+            return 431;     // 单个请求头过长
+        if (strcmp(line, "\n") == 0)
+            break;
+
+        q = strchr(line, ':');
+        if (q == NULL || q == line)
+            continue;   // 忽略格式错误的请求头
+        name_len = q - line;
+        *q++ = '\0';
+        while (*q == ' ' || *q == '\t')
+            q++;
+        end = line + n;
+        while (end > q && ISspace(end[-1]))
+            end--;
+        *end = '\0';
+
+        if (strcasecmp(line, "Content-Length") == 0)
+            req->content_length = atol(q);
+        else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+            // 只支持分块编码
+            if (strcasecmp(q, "chunked") != 0)
+                bad_encoding = 1;
+            req->chunked = 1;
+        }
+        // 请求头总长度超出arena中可用的部分
+        if (a->size - a->used < ARENA_RESERVE + name_len + (end - q) + 32)
+            return 431;
+        if (req->num_headers < MAX_HEADERS) {
+            struct header *h = &req->headers[req->num_headers];
+            h->name = arena_strndup(a, line, name_len);
+            h->value = arena_strndup(a, q, end - q);
+            if (h->name == NULL || h->value == NULL)
+                return 400;
+            req->num_headers++;
+        }
+    }
+
+    // 分离查询字符串，例如：/path?param=value
+    p = strchr(req->url, '?');
+    if (p != NULL) {
+        *p = '\0';
+        req->query_string = p + 1;
+    }
+
+    // HTTP/1.1默认保持连接，HTTP/1.0需要显式要求
+    connection = request_header(req, "Connection");
+    if (strcasecmp(req->version, "HTTP/1.1") == 0)
+        req->keep_alive = !(connection && strcasecmp(connection, "close") == 0);
+    else if (strcasecmp(req->version, "HTTP/1.0") == 0)
+        req->keep_alive = connection && strcasecmp(connection, "keep-alive") == 0;
+
+    // 同时出现时以Transfer-Encoding为准
+    if (req->chunked)
+        req->content_length = -1;
+
+    if (strcasecmp(req->method, "GET") && strcasecmp(req->method, "POST"))
+        return 501;
+    if (bad_encoding)
+        return 501;
+    return 0;
+}
+
+/**********************************************************************/
+/* 判断客户端的Accept-Encoding是否接受某种内容编码，q=0表示拒绝
+ * Returns: 1 接受，0 不接受 */
+/**********************************************************************/
+static int accepts_encoding(const struct request *req, const char *coding)
+{
+    const char *p = request_header(req, "Accept-Encoding");
+    const char *tok;
+    size_t toklen, n = strlen(coding);
+    int ok;
+
+    while (p != NULL && *p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        for (tok = p; *p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'; p++)
+            ;
+        toklen = p - tok;
+        ok = 1;
+        // 参数部分，只关心q值
+        while (*p && *p != ',') {
+            if (*p == ';') {
+                for (p++; *p == ' ' || *p == '\t'; p++)
+                    ;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                    ok = atof(p + 2) > 0;
+                continue;
+            }
+            p++;
+        }
+        if (toklen == n && strncasecmp(tok, coding, n) == 0)
+            return ok;
+    }
+    return 0;
+}
+
+/**********************************************************************/
+/* 按HTTP格式生成当前时间 */
+/**********************************************************************/
+static void http_date(char *buf, size_t size)
+{
+    time_t now = time(0);
+    struct tm tm;
+
+    gmtime_r(&now, &tm);
+    strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+/**********************************************************************/
+/* 把一组iovec完整写出，处理部分写入的情况
+ * Returns: 0 成功，-1 出错 */
+/**********************************************************************/
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0) {
+        n = writev(fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/**********************************************************************/
+/* 静态资源包
+ * 配置了bundle时，启动时把htpack生成的资源包mmap进来（格式见
+ * bundle.h）。GET请求先在资源包的哈希索引中查找，命中后用一次
+ * writev发送预先生成的响应头和映射中的内容，不访问文件系统；
+ * 未命中时照常回退到document_root。 */
+/**********************************************************************/
+
+static const char *bundle_base = NULL;
+static size_t bundle_size = 0;
+
+/**********************************************************************/
+/* 检查资源包中的一段区域是否越界 */
+/**********************************************************************/
+static int bundle_range_ok(uint64_t off, uint64_t len)
+{
+    return off <= bundle_size && len <= bundle_size - off;
+}
+
+/**********************************************************************/
+/* 映射并校验资源包，只在启动时调用一次。失败时打印原因并继续只使用
+ * document_root提供服务。 */
+/**********************************************************************/
+static void bundle_init(void)
+{
+    const struct bundle_header *hdr;
+    const struct bundle_entry *entries;
+    const uint32_t *buckets;
+    struct stat st;
+    const char *base;
+    uint32_t k;
+    int fd, v;
+
+    if (config.bundle[0] == '\0')
+        return;
+    fd = open(config.bundle, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(config.bundle);
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "%s: not a bundle\n", config.bundle);
+        close(fd);
+        return;
+    }
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        return;
+    }
+    bundle_size = st.st_size;
+
+    hdr = (const struct bundle_header *)base;
+    if (memcmp(hdr->magic, BUNDLE_MAGIC, 4) != 0 || hdr->version != BUNDLE_VERSION ||
+        hdr->nbuckets == 0 || (hdr->nbuckets & (hdr->nbuckets - 1)) != 0 ||
+        !bundle_range_ok(hdr->buckets_off, (uint64_t)hdr->nbuckets * sizeof(uint32_t)) ||
+        !bundle_range_ok(hdr->entries_off, (uint64_t)hdr->nentries * sizeof(struct bundle_entry)) ||
+        hdr->buckets_off % 4 != 0 || hdr->entries_off % 8 != 0)
+        goto bad;
+    buckets = (const uint32_t *)(base + hdr->buckets_off);
+    for (k = 0; k < hdr->nbuckets; k++)
+        if (buckets[k] > hdr->nentries)
+            goto bad;
+    entries = (const struct bundle_entry *)(base + hdr->entries_off);
+    for (k = 0; k < hdr->nentries; k++) {
+        // htpack把表项插在链表头部，next总是指向更早的表项，因此链表不会成环
+        if (entries[k].next > k ||
+            !bundle_range_ok(entries[k].path_off, entries[k].path_len))
+            goto bad;
+        for (v = 0; v < BUNDLE_NVARIANTS; v++)
+            if (entries[k].variants[v].headers_len != 0 &&
+                (!bundle_range_ok(entries[k].variants[v].headers_off,
+                                  entries[k].variants[v].headers_len) ||
+                 !bundle_range_ok(entries[k].variants[v].body_off,
+                                  entries[k].variants[v].body_len)))
+                goto bad;
+    }
+
+    // 资源包很小，提前读入页缓存，第一个请求也不会缺页
+    madvise((void *)base, bundle_size, MADV_WILLNEED);
+    bundle_base = base;
+    printf("serving %u files from %s\n", hdr->nentries, config.bundle);
+    return;
+
+bad:
+    fprintf(stderr, "%s: corrupt or incompatible bundle\n", config.bundle);
+    munmap((void *)base, bundle_size);
+    bundle_size = 0;
+}
+
+/**********************************************************************/
+/* 在资源包中查找URL
+ * Returns: 对应的表项，不存在时返回NULL */
+/**********************************************************************/
+static const struct bundle_entry *bundle_lookup(const char *url)
+{
+    const struct bundle_header *hdr = (const struct bundle_header *)bundle_base;
+    const uint32_t *buckets = (const uint32_t *)(bundle_base + hdr->buckets_off);
+    const struct bundle_entry *entries =
+        (const struct bundle_entry *)(bundle_base + hdr->entries_off);
+    const struct bundle_entry *e;
+    size_t n = strlen(url);
+    uint32_t h = bundle_hash(url, n);
+    uint32_t idx;
+
+    for (idx = buckets[h & (hdr->nbuckets - 1)]; idx != 0; idx = e->next) {
+        e = &entries[idx - 1];
+        if (e->hash == h && e->path_len == n &&
+            memcmp(bundle_base + e->path_off, url, n) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/**********************************************************************/
+/* Send a resource from the bundle, picking the best encoding the
+ * client accepts and answering 304 when its ETag still matches.
+ * Parameters: the client connection
+ *             the bundle entry found by bundle_lookup() */
+/**********************************************************************/
+static void serve_bundle(struct connection *conn, const struct bundle_entry *e)
+{
+    struct request *req = &conn->req;
+    const struct bundle_variant *var = &e->variants[BUNDLE_IDENTITY];
+    const char *inm;
+    char date_str[100];
+    char tail[256];
+    struct iovec iov[3];
+    int n;
+
+    if (e->variants[BUNDLE_BR].headers_len != 0 && accepts_encoding(req, "br"))
+        var = &e->variants[BUNDLE_BR];
+    else if (e->variants[BUNDLE_GZIP].headers_len != 0 && accepts_encoding(req, "gzip"))
+        var = &e->variants[BUNDLE_GZIP];
+
+    // 未读取的请求体会被当成下一个请求，因此这种情况下不保持连接
+    if (req->content_length > 0 || req->chunked)
+        req->keep_alive = 0;
+
+    http_date(date_str, sizeof(date_str));
+    inm = request_header(req, "If-None-Match");
+    if (inm != NULL && (strcmp(inm, "*") == 0 || strstr(inm, var->etag) != NULL)) {
+        n = snprintf(tail, sizeof(tail),
+                     "HTTP/1.1 304 Not Modified\r\n"
+                     SERVER_STRING
+                     "ETag: %s\r\n"
+                     DATE
+                     CONNECTION
+                     "\r\n",
+                     var->etag, date_str, req->keep_alive ? "keep-alive" : "close");
+        send(conn->fd, tail, n, 0);
+        req->status = 304;
+        return;
+    }
+
+    n = snprintf(tail, sizeof(tail), DATE CONNECTION "\r\n",
+                 date_str, req->keep_alive ? "keep-alive" : "close");
+    iov[0].iov_base = (void *)(bundle_base + var->headers_off);
+    iov[0].iov_len = var->headers_len;
+    iov[1].iov_base = tail;
+    iov[1].iov_len = n;
+    iov[2].iov_base = (void *)(bundle_base + var->body_off);
+    iov[2].iov_len = var->body_len;
+    if (writev_all(conn->fd, iov, 3) == -1)
+        req->keep_alive = 0;
+    req->status = 200;
+}
+
+/**********************************************************************/
+/* 动态gzip压缩缓存
+ * 客户端接受gzip、文件属于可压缩类型且旁边没有预压缩的.gz/.br文件
+ * 时，第一次请求在线压缩，压缩结果按路径缓存在内存中，之后的请求
+ * 直接发送缓存的数据。缓存总大小受gzip_cache_size限制，超出时按
+ * LRU淘汰；文件的inode、大小或修改时间变化后对应的缓存自动失效。
+ * 压缩后没有变小的文件也会记下来，避免重复压缩。 */
+/**********************************************************************/
+
+#define GZIP_BUCKETS 256        // 必须是2的幂
+
+struct gzip_entry {
+    struct gzip_entry *hnext;           // 哈希链
+    struct gzip_entry *prev, *next;     // LRU链表，表头是最近使用的
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *data;                 // 压缩后的数据，NULL表示压缩后没有变小
+    size_t len;
+    size_t cost;                // 计入缓存总大小的字节数
+    int refs;                   // 正在发送该数据的请求数
+    int dead;                   // 已从缓存中移除，最后一个引用释放时回收
+};
+
+static pthread_mutex_t gzip_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct gzip_entry *gzip_table[GZIP_BUCKETS];
+static struct gzip_entry *gzip_lru_head = NULL, *gzip_lru_tail = NULL;
+static size_t gzip_cache_bytes = 0;
+
+/**********************************************************************/
+/* 判断某种Content-Type是否值得压缩 */
+/**********************************************************************/
+static int compressible_type(const char *type)
+{
+    return strncmp(type, "text/", 5) == 0 ||
+           strcmp(type, "application/javascript") == 0 ||
+           strcmp(type, "application/json") == 0 ||
+           strcmp(type, "image/svg+xml") == 0;
+}
+
+static void gzip_free(struct gzip_entry *e)
+{
+    free(e->path);
+    free(e->data);
+    free(e);
+}
+
+/**********************************************************************/
+/* 把表项从哈希表和LRU链表中摘下，调用者须持有gzip_lock */
+/**********************************************************************/
+static void gzip_unlink(struct gzip_entry *e)
+{
+    struct gzip_entry **pp;
+
+    pp = &gzip_table[bundle_hash(e->path, strlen(e->path)) & (GZIP_BUCKETS - 1)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+    if (e->prev) e->prev->next = e->next; else gzip_lru_head = e->next;
+    if (e->next) e->next->prev = e->prev; else gzip_lru_tail = e->prev;
+    gzip_cache_bytes -= e->cost;
+    e->dead = 1;
+    if (e->refs == 0)
+        gzip_free(e);
+}
+
+/**********************************************************************/
+/* 读取整个文件并压缩成gzip格式
+ * Returns: 新的缓存表项（未加入缓存），出错时返回NULL */
+/**********************************************************************/
+static struct gzip_entry *gzip_compress_file(const char *path,
+        const struct stat *st, int fd)
+{
+    struct gzip_entry *e;
+    char *raw;
+    z_stream zs;
+    size_t cap;
+    int ok;
+
+    e = calloc(1, sizeof(*e));
+    raw = malloc(st->st_size ? st->st_size : 1);
+    // 用pread读取，不移动文件偏移，压缩失败时调用者仍可从头发送原文件
+    ok = e != NULL && raw != NULL &&
+         pread(fd, raw, st->st_size, 0) == (ssize_t)st->st_size;
+    if (!ok || (e->path = strdup(path)) == NULL) {
+        free(raw);
+        free(e);
+        return NULL;
+    }
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtim;
+
+    memset(&zs, 0, sizeof(zs));
+    cap = deflateBound(NULL, st->st_size) + 32;
+    // windowBits为15+16时输出gzip格式
+    if ((e->data = malloc(cap)) != NULL &&
+        deflateInit2(&zs, config.gzip_level, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) == Z_OK) {
+        zs.next_in = (Bytef *)raw;
+        zs.avail_in = st->st_size;
+        zs.next_out = (Bytef *)e->data;
+        zs.avail_out = cap;
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END && zs.total_out < (uLong)st->st_size)
+            e->len = zs.total_out;
+        deflateEnd(&zs);
+    }
+    if (e->len == 0) {
+        free(e->data);
+        e->data = NULL;
+    }
+    free(raw);
+    e->cost = sizeof(*e) + strlen(path) + e->len;
+    return e;
+}
+
+/**********************************************************************/
+/* 取得一个文件的gzip版本，缓存未命中时在线压缩并放入缓存。
+ * Parameters: the file path, its stat information and its descriptor
+ * Returns: 增加了引用计数的表项（用完后调用gzip_cache_release），
+ *          出错时返回NULL */
+/**********************************************************************/
+static struct gzip_entry *gzip_cache_get(const char *path,
+        const struct stat *st, int fd)
+{
+    struct gzip_entry *e, *fresh;
+    uint32_t b = bundle_hash(path, strlen(path)) & (GZIP_BUCKETS - 1);
+    uint64_t t;
+
+    pthread_mutex_lock(&gzip_lock);
+    for (e = gzip_table[b]; e != NULL; e = e->hnext)
+        if (strcmp(e->path, path) == 0)
+            break;
+    if (e != NULL && (e->dev != st->st_dev || e->ino != st->st_ino ||
+                      e->size != st->st_size ||
+                      e->mtime.tv_sec != st->st_mtim.tv_sec ||
+                      e->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        gzip_unlink(e);     // 文件已经变化
+        e = NULL;
+    }
+    if (e != NULL) {
+        // 命中：移到LRU表头
+        if (e != gzip_lru_head) {
+            e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev; else gzip_lru_tail = e->prev;
+            e->prev = NULL;
+            e->next = gzip_lru_head;
+            gzip_lru_head->prev = e;
+            gzip_lru_head = e;
+        }
+        e->refs++;
+        pthread_mutex_unlock(&gzip_lock);
+        return e;
+    }
+    pthread_mutex_unlock(&gzip_lock);
+
+    // 未命中：在锁外压缩，避免阻塞其他请求
+    t = trace_begin("gzip");
+    fresh = gzip_compress_file(path, st, fd);
+    trace_end("gzip", t);
+    if (fresh == NULL)
+        return NULL;
+    fresh->refs = 1;
+
+    pthread_mutex_lock(&gzip_lock);
+    for (e = gzip_table[b]; e != NULL; e = e->hnext)
+        if (strcmp(e->path, path) == 0)
+            break;
+    if (e != NULL || fresh->cost > (size_t)config.gzip_cache_size) {
+        // 其他线程已经放入了同一个文件，或者单个结果就超出缓存大小
+        fresh->dead = 1;
+        pthread_mutex_unlock(&gzip_lock);
+        return fresh;
+    }
+    // 从LRU表尾淘汰，正在被发送的表项跳过
+    for (e = gzip_lru_tail; e != NULL &&
+         gzip_cache_bytes + fresh->cost > (size_t)config.gzip_cache_size; ) {
+        struct gzip_entry *prev = e->prev;
+        if (e->refs == 0)
+            gzip_unlink(e);
+        e = prev;
+    }
+    fresh->hnext = gzip_table[b];
+    gzip_table[b] = fresh;
+    fresh->next = gzip_lru_head;
+    if (gzip_lru_head) gzip_lru_head->prev = fresh; else gzip_lru_tail = fresh;
+    gzip_lru_head = fresh;
+    gzip_cache_bytes += fresh->cost;
+    pthread_mutex_unlock(&gzip_lock);
+    return fresh;
+}
+
+/**********************************************************************/
+/* 释放gzip_cache_get()返回的引用 */
+/**********************************************************************/
+static void gzip_cache_release(struct gzip_entry *e)
+{
+    pthread_mutex_lock(&gzip_lock);
+    if (--e->refs == 0 && e->dead)
+        gzip_free(e);
+    pthread_mutex_unlock(&gzip_lock);
+}
+
+/**********************************************************************/
+/* 打开一个文件旁边的预压缩版本（例如index.html.br）。预压缩文件
+ * 比原文件旧时认为已经过期，不使用。
+ * 原文件所在目录已经通过了document_root检查，预压缩文件本身不允许
+ * 是符号链接，否则可以借它读取document_root之外的文件。
+ * Returns: 打开的文件描述符，不存在或已过期时返回-1 */
+/**********************************************************************/
+static int open_sidecar(struct connection *conn, const char *filename,
+        const char *suffix, const struct stat *orig, struct stat *st)
+{
+    size_t len = strlen(filename) + strlen(suffix) + 1;
+    char *side = arena_alloc(&conn->arena, len);
+    int fd;
+
+    if (side == NULL)
+        return -1;
+    snprintf(side, len, "%s%s", filename, suffix);
+    fd = open(side, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode) ||
+        st->st_mtime < orig->st_mtime) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**********************************************************************/
+/* 大文件发送
+ * 不小于large_file_size的文件不经过cat()，而是：
+ *  - posix_fadvise(SEQUENTIAL)加大内核预读，并在发送每一片之前
+ *    WILLNEED预取下一片
+ *  - 用sendfile按sendfile_chunk分片发送，内容不经过用户态；每片
+ *    之后线程都会回到调度器，慢客户端也受发送超时限制，单个大下载
+ *    不会长时间独占CPU或磁盘带宽
+ *  - 最近没有被请求过的文件视为一次性的冷文件：发送过程中对落后
+ *    一片以上、从文件开头算起的已发送区间POSIX_FADV_DONTNEED，发送
+ *    结束后再对整个已发送区间做一次，避免把热点资源挤出页缓存。
+ *    只对刚发送的一片做DONTNEED不够：跨越片边界的大页（folio）和仍被
+ *    发送中的skb引用的页会被内核跳过，之后也不会再处理 */
+/**********************************************************************/
+
+#define HEAT_TABLE_SIZE 256     // 必须是2的幂
+#define HEAT_WINDOW 600         // 两次请求间隔在该秒数内才算热文件
+
+struct file_heat {
+    dev_t dev;
+    ino_t ino;
+    time_t last;
+    unsigned hits;
+};
+
+static pthread_mutex_t heat_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct file_heat heat_table[HEAT_TABLE_SIZE];
+
+/**********************************************************************/
+/* 记录一次对大文件的访问
+ * Returns: 1 最近被请求过（热文件），0 冷文件 */
+/**********************************************************************/
+static int file_is_hot(const struct stat *st)
+{
+    struct file_heat *h;
+    time_t now = time(NULL);
+    int hot;
+
+    h = &heat_table[((uint32_t)st->st_ino * 2654435761u ^ (uint32_t)st->st_dev)
+                    & (HEAT_TABLE_SIZE - 1)];
+    pthread_mutex_lock(&heat_lock);
+    if (h->dev == st->st_dev && h->ino == st->st_ino && now - h->last <= HEAT_WINDOW)
+        h->hits++;
+    else {
+        h->dev = st->st_dev;
+        h->ino = st->st_ino;
+        h->hits = 1;
+    }
+    h->last = now;
+    hot = h->hits > 1;
+    pthread_mutex_unlock(&heat_lock);
+    return hot;
+}
+
+/**********************************************************************/
+/* Stream a large file to the client with sendfile in bounded slices,
+ * giving the kernel readahead hints along the way.
+ * Parameters: the client socket
+ *             descriptor of the file to send
+ *             its stat information
+ * Returns: 0 if the whole file was sent, -1 otherwise */
+/**********************************************************************/
+static int send_large_file(int client, int fd, const struct stat *st)
+{
+    off_t off = 0;
+    off_t chunk = config.sendfile_chunk > 0 ? config.sendfile_chunk : 512 * 1024;
+    int hot = file_is_hot(st);
+    ssize_t n;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    while (off < st->st_size) {
+        // 发送当前片的同时让内核预读下一片
+        posix_fadvise(fd, off + chunk, chunk, POSIX_FADV_WILLNEED);
+        n = sendfile(client, fd, &off,
+                     st->st_size - off < chunk ? (size_t)(st->st_size - off) : (size_t)chunk);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;      // 客户端断开、发送超时或文件被截断
+        // 冷文件发送过的部分不再需要留在页缓存中，落后一片以免碰到仍在发送的页
+        if (!hot && off > chunk)
+            posix_fadvise(fd, 0, off - chunk, POSIX_FADV_DONTNEED);
+    }
+    if (!hot && off > 0)
+        posix_fadvise(fd, 0, off, POSIX_FADV_DONTNEED);
+    return off == st->st_size ? 0 : -1;
+}
+
+/**********************************************************************/
+/* 套接字调优
+ * 监听套接字上的TCP_DEFER_ACCEPT、TCP_FASTOPEN和backlog在startup()中
+ * 设置；这里是每个连接上的选项：
+ *  - TCP_NODELAY：关闭Nagle算法，keep-alive连接上响应的最后一个不满
+ *    的报文段不必等待上一个ACK（避免与延迟ACK叠加出的几十毫秒延迟）
+ *  - TCP_CORK：静态文件的响应头和文件内容先攒成满的报文段，发送完
+ *    后再拔掉“塞子”立即发出剩余数据，响应头不会单独占一个小包 */
+/**********************************************************************/
+
+static void socket_tune(int fd)
+{
+    int on = 1;
+
+    if (config.tcp_nodelay)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static void socket_cork(int fd, int on)
+{
+    if (config.tcp_cork)
+        setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/**********************************************************************/
+/* CGI请求体与响应的分帧
+ * 请求体可以是Content-Length或分块编码（chunked）。CGI程序需要
+ * CONTENT_LENGTH，所以分块编码的请求体先解码到内存中再交给CGI。
+ * CGI输出的响应头（Status、Content-Type、Content-Length、Location
+ * 等）由服务器解析后重新生成HTTP/1.1响应头：CGI给出Content-Length
+ * 时直接使用；否则对HTTP/1.1客户端改用分块编码发送，两种情况下
+ * 连接都可以保持。只有HTTP/1.0客户端才以关闭连接结束响应。 */
+/**********************************************************************/
+
+#define CGI_HEADER_MAX 8192             // CGI响应头的最大长度
+#define CGI_BUF_SIZE 16384              // 转发CGI输出时的缓冲区大小
+#define MAX_CHUNKED_BODY (1024 * 1024)  // 分块编码请求体解码后的最大长度
+
+/**********************************************************************/
+/* 读取并解码分块编码的请求体（包括结尾的trailer）
+ * Parameters: the client connection
+ *             where to store the decoded body (malloc'ed)
+ *             where to store its length
+ * Returns: 0 成功，-1 格式错误、过大或连接中断 */
+/**********************************************************************/
+static int read_chunked_body(struct connection *conn, char **body, long *len)
+{
+    char *buf = NULL, *end, *grown;
+    size_t used = 0, cap = 0;
+    long size;
+    ssize_t n;
+
+    while (1) {
+        if (get_line(conn, conn->line, sizeof(conn->line)) == 0)
+            goto fail;
+        // 块大小后面可能带有;扩展参数，忽略
+        size = strtol(conn->line, &end, 16);
+        if (end == conn->line || size < 0 || size > MAX_CHUNKED_BODY - (long)used)
+            goto fail;
+        if (size == 0)
+            break;
+        if (used + size > cap) {
+            cap = (used + size) * 2 > MAX_CHUNKED_BODY ? MAX_CHUNKED_BODY : (used + size) * 2;
+            if ((grown = realloc(buf, cap)) == NULL)
+                goto fail;
+            buf = grown;
+        }
+        while (size > 0) {
+            n = conn_read(conn, buf + used, size);
+            if (n <= 0)
+                goto fail;
+            used += n;
+            size -= n;
+        }
+        // 块数据后面的CRLF
+        if (get_line(conn, conn->line, sizeof(conn->line)) == 0 ||
+            strcmp(conn->line, "\n") != 0)
+            goto fail;
+    }
+    // trailer部分，直到空行
+    do {
+        if (get_line(conn, conn->line, sizeof(conn->line)) == 0)
+            goto fail;
+    } while (strcmp(conn->line, "\n") != 0);
+
+    if (buf == NULL && (buf = malloc(1)) == NULL)
+        return -1;
+    *body = buf;
+    *len = used;
+    return 0;
+
+fail:
+    free(buf);
+    return -1;
+}
+
+/**********************************************************************/
+/* 常见状态码对应的原因短语 */
+/**********************************************************************/
+static const char *status_reason(int status)
+{
+    switch (status) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 204: return "No Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 400: return "Bad Request";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 500: return "Internal Server Error";
+    default:  return "Unknown";
+    }
+}
+
+/**********************************************************************/
+/* 用一次writev发送一个分块：可选的前缀（例如响应头）、块大小行、
+ * 数据和结尾的CRLF。len为0时只发送前缀。
+ * Returns: 0 成功，-1 出错 */
+/**********************************************************************/
+static int send_chunk(int client, const char *prefix, size_t prefix_len,
+        const char *data, size_t len)
+{
+    char size_line[32];
+    struct iovec iov[4];
+    int cnt = 0;
 
-/*
- * 这是一个简单的HTTP服务器实现
- * 主要功能：
- * 1. 处理基本的HTTP GET和POST请求
- * 2. 支持静态文件服务
- * 3. 支持CGI脚本执行
- * 4. 多线程处理客户端请求
- */
+    if (prefix_len > 0) {
+        iov[cnt].iov_base = (void *)prefix;
+        iov[cnt++].iov_len = prefix_len;
+    }
+    if (len > 0) {
+        iov[cnt].iov_base = size_line;
+        iov[cnt++].iov_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", len);
+        iov[cnt].iov_base = (void *)data;
+        iov[cnt++].iov_len = len;
+        iov[cnt].iov_base = "\r\n";
+        iov[cnt++].iov_len = 2;
+    }
+    return cnt > 0 ? writev_all(client, iov, cnt) : 0;
+}
 
-void accept_request(void *); // 处理HTTP请求
-void bad_request(int);      // 发送400错误响应
-void cat(int, FILE *);      // 发送文件内容
-void cannot_execute(int);   // 发送500错误响应
-void error_die(const char *); // 错误处理和退出
-void execute_cgi(int, const char *, const char *, const char *); // 执行CGI脚本
-int get_line(int, char *, int); // 读取一行HTTP请求
-void headers(int, const char *); // 发送HTTP响应头
-void not_found(int);        // 发送404错误响应
-void serve_file(int, const char *); // 处理静态文件请求
-int startup(u_short *);     // 启动服务器
-void unimplemented(int);    // 发送501错误响应
-void log_access(const char *format, ...); // 记录访问日志
-const char* get_content_type(const char *filename); // 添加这一行声明
+/**********************************************************************/
+/* 从CGI输出中尽量多读一些已经到达的数据，把多次小的写合并成一个块。
+ * 第一次读取会阻塞，之后只读取管道中已有的数据。
+ * Returns: 读到的字节数，0表示CGI输出已结束 */
+/**********************************************************************/
+static ssize_t read_coalesced(int fd, char *buf, size_t size)
+{
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    size_t used = 0;
+    ssize_t n;
 
-// 添加配置结构
-typedef struct {
-    int port;
-    char document_root[512];
-    int max_clients;
-    int timeout;
-} server_config;
+    while (used < size) {
+        if (used > 0 && poll(&pfd, 1, 0) <= 0)
+            break;
+        n = read(fd, buf + used, size - used);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        used += n;
+    }
+    return used;
+}
 
-// 添加配置读取函数
-server_config read_config(const char *filename) 
+/**********************************************************************/
+/* 在CGI输出中查找响应头结束的空行
+ * Returns: 响应体开始的位置，没有找到时返回NULL */
+/**********************************************************************/
+static char *cgi_header_end(char *buf, size_t len)
 {
-    server_config config = {
-        .port = 4000,
-        .document_root = "htdocs",
-        .max_clients = 1000,
-        .timeout = 60
-    };
-    
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) return config;
-    
-    char line[1024];
-    char key[64], value[960];
-    
-    while (fgets(line, sizeof(line), fp)) {
-        if (line[0] == '#' || line[0] == '\n') continue;
-        
-        if (sscanf(line, "%63[^=]=%959s", key, value) == 2) {
-            if (strcmp(key, "port") == 0)
-                config.port = atoi(value);
-            else if (strcmp(key, "document_root") == 0)
-                strncpy(config.document_root, value, sizeof(config.document_root)-1);
-            else if (strcmp(key, "max_clients") == 0)
-                config.max_clients = atoi(value);
-            else if (strcmp(key, "timeout") == 0)
-                config.timeout = atoi(value);
-        }
+    size_t i;
+
+    // 没有任何响应头，直接以空行开始
+    if (len >= 1 && buf[0] == '\n')
+        return buf + 1;
+    if (len >= 2 && buf[0] == '\r' && buf[1] == '\n')
+        return buf + 2;
+    for (i = 0; i < len; i++) {
+        if (buf[i] != '\n')
+            continue;
+        if (i + 1 < len && buf[i + 1] == '\n')
+            return buf + i + 2;
+        if (i + 2 < len && buf[i + 1] == '\r' && buf[i + 2] == '\n')
+            return buf + i + 3;
     }
-    
-    fclose(fp);
-    return config;
+    return NULL;
 }
 
 /**********************************************************************/
 /* A request has caused a call to accept() on the server port to
  * return.  Process the request appropriately.
- * Parameters: the socket connected to the client */
+ * Parameters: the connection handed over by main() */
 /**********************************************************************/
 void accept_request(void *arg)
+{
+    struct connection *conn = arg;
+    struct timeval tv;
+
+    pthread_detach(pthread_self());
+
+    // 空闲的keep-alive连接在timeout秒后关闭，发送停滞同样如此
+    if (config.timeout > 0) {
+        tv.tv_sec = config.timeout;
+        tv.tv_usec = 0;
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        // 不读取响应的客户端也不能无限期占住线程
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+    socket_tune(conn->fd);
+    // 同一连接上的请求依次处理，每个请求开始前重置arena
+    do {
+        arena_reset(&conn->arena);
+    } while (process_request(conn));
+
+    conn_close(conn);
+    admission_release(conn->ip_slot);
+    conn_put(conn);
+}
+
+/**********************************************************************/
+/* Parse a single request from the connection and dispatch it to the
+ * static file or CGI handler.
+ * Parameters: the client connection
+ * Returns: 1 if the connection should be kept open for another
+ *          request, 0 if it should be closed */
+/**********************************************************************/
+int process_request(struct connection *conn)
 {
     /* 处理HTTP请求的主要步骤：
-     * 1. 解析HTTP请求行，获取方法、URL和HTTP版本
-     * 2. 如果是GET请求，解析URL中的查询字符串
-     * 3. 如果是POST请求，获取Content-Length
-     * 4. 确定是否需要CGI处理（有查询字符串或POST请求）
-     * 5. 构建本地文件路径
-     * 6. 根据请求类型调用相应的处理函数
+     * 1. 解析HTTP请求行和请求头，得到方法、URL、查询字符串和Content-Length
+     * 2. 确定是否需要CGI处理（有查询字符串或POST请求）
+     * 3. 构建本地文件路径
+     * 4. 根据请求类型调用相应的处理函数
      */
-    int client = (intptr_t)arg; // 将传入的参数转换为客户端套接字描述符
-    char buf[1024]; // 用于存储从客户端读取的数据
-    size_t numchars; // 读取的字符数
-    char method[255]; // 存储请求方法（GET 或 POST）
-    char url[255]; // 存储请求的 URL
-    char path[512]; // 存储请求的文件路径
-    size_t i, j;
+    struct request *req = &conn->req;
     struct stat st; // 用于获取文件状态信息
+    char resolved[PATH_MAX]; // realpath()解析后的路径
+    char addr_str[INET_ADDRSTRLEN];
+    size_t len, root_len;
     int cgi = 0; // 标记是否为 CGI 请求
-    char *query_string = NULL; // 存储查询字符串
-
-    /* 处理HTTP请求的主要步骤：
-     * 1. 解析HTTP请求方法（GET/POST）
-     * 2. 解析URL和查询字符串
-     * 3. 确定是否需要CGI处理
-     * 4. 处理静态文件或执行CGI脚本
-     */
+    int status;
+    uint64_t t;
 
-    // 获取HTTP请求的第一行
-    numchars = get_line(client, buf, sizeof(buf));
-    
-    // 解析HTTP方法（GET/POST）
-    while (!ISspace(buf[i]) && (i < sizeof(method) - 1))
-    {
-        method[i] = buf[i];
-        i++;
+    status = parse_request(conn);
+    if (status < 0) {
+        // 读到请求行之后才断开的请求已经开始追踪，需要与request__start配对
+        if (req->method != NULL)
+            trace_request_end(req);
+        return 0;   // 客户端已关闭连接或读取超时
     }
-    j = i;
-    method[i] = '\0';
-
-    // 检查是否支持该HTTP方法
-    if (strcasecmp(method, "GET") && strcasecmp(method, "POST"))
-    {
-        unimplemented(client);
-        return;
+    // get_line阶段从trace_request_begin()记录的请求开始时间算起
+    trace_end("get_line", trace_req_start);
+    if (status != 0) {
+        if (status == 501)
+            unimplemented(conn->fd);
+        else if (status == 431)
+            header_too_large(conn->fd);
+        else
+            bad_request(conn->fd);
+        req->status = status;
+        req->keep_alive = 0;
+        goto out;
     }
 
-    // POST请求一定需要CGI处理
-    if (strcasecmp(method, "POST") == 0)
+    // POST请求和带查询字符串的GET请求都需要CGI处理
+    if (strcasecmp(req->method, "POST") == 0 || req->query_string != NULL)
         cgi = 1;
 
-    i = 0;
-    // 跳过空白字符
-    while (ISspace(buf[j]) && (j < numchars))
-        j++;
-    // 解析 URL
-    while (!ISspace(buf[j]) && (i < sizeof(url) - 1) && (j < numchars))
-    {
-        url[i] = buf[j];
-        i++; j++;
+    // 检查路径中是否包含 ..
+    if (strstr(req->url, "..") != NULL) {
+        bad_request(conn->fd);
+        req->status = 400;
+        req->keep_alive = 0;
+        goto out;
     }
-    url[i] = '\0';
 
-    /* 处理GET请求的查询字符串
-     * 如果URL中包含?，则需要CGI处理
-     * 例如：/path?param=value
-     */
-    if (strcasecmp(method, "GET") == 0)
-    {
-        query_string = url;
-        while ((*query_string != '?') && (*query_string != '\0'))
-            query_string++;
-        if (*query_string == '?')
-        {
-            cgi = 1;
-            *query_string = '\0';
-            query_string++;
+    // 先在静态资源包中查找，未命中再访问文件系统
+    if (bundle_base != NULL && !cgi) {
+        const struct bundle_entry *e;
+        char *key = (char *)req->url;
+
+        if (key[strlen(key) - 1] == '/') {
+            len = strlen(req->url) + strlen("index.html") + 1;
+            if ((key = arena_alloc(&conn->arena, len)) != NULL)
+                snprintf(key, len, "%sindex.html", req->url);
         }
+        t = trace_begin("bundle");
+        e = key != NULL ? bundle_lookup(key) : NULL;
+        if (e != NULL)
+            serve_bundle(conn, e);
+        trace_end("bundle", t);
+        if (e != NULL)
+            goto out;
     }
 
     /* 构建本地文件路径
-     * 所有文件都存放在htdocs目录下
-     * 如果请求的是目录，默认返回index.html
+     * 所有文件都存放在document_root目录下，路径长度按URL实际长度从
+     * arena中分配；如果请求的是目录，默认返回index.html
      */
-    sprintf(path, "htdocs%s", url);
-    if (path[strlen(path) - 1] == '/')
-        strcat(path, "index.html");
+    root_len = strlen(config.document_root);
+    len = root_len + strlen(req->url) + 2 * strlen("/index.html") + 1;
+    req->path = arena_alloc(&conn->arena, len);
+    if (req->path == NULL) {
+        bad_request(conn->fd);
+        req->status = 400;
+        req->keep_alive = 0;
+        goto out;
+    }
+    snprintf(req->path, len, "%s%s", config.document_root, req->url);
+    if (req->path[strlen(req->path) - 1] == '/')
+        strcat(req->path, "index.html");
 
     // 检查文件是否存在和访问权限
-    if (stat(path, &st) == -1) {
-        // 文件不存在，返回404错误
-        while ((numchars > 0) && strcmp("\n", buf))
-            numchars = get_line(client, buf, sizeof(buf));
-        not_found(client);
-    }
-    else
-    {
+    t = trace_begin("stat");
+    if (stat(req->path, &st) == -1)
+        st.st_mode = 0;
+    else if (S_ISDIR(st.st_mode)) {
         // 如果是目录，添加默认的index.html
-        if ((st.st_mode & S_IFMT) == S_IFDIR)
-            strcat(path, "/index.html");
-        
-        // 如果文件有执行权限，认为是CGI脚本
-        if ((st.st_mode & S_IXUSR) ||
-            (st.st_mode & S_IXGRP) ||
-            (st.st_mode & S_IXOTH))
-            cgi = 1;
-        
-        // 检查路径中是否包含 ..
-        if (strstr(url, "..") != NULL) {
-            bad_request(client);
-            return;
-        }
-        
-        // 检查请求的文件路径是否超出htdocs目录
-        char real_path[512];
-        char *htdocs_path = realpath("htdocs", NULL);
-        if (realpath(path, real_path) == NULL || 
-            strncmp(real_path, htdocs_path, strlen(htdocs_path)) != 0) {
-            not_found(client);
-            free(htdocs_path);
-            return;
-        }
-        free(htdocs_path);
-        
-        // 根据是否是CGI请求选择处理方式
-        if (!cgi)
-            serve_file(client, path);
-        else
-            execute_cgi(client, path, method, query_string);
+        strcat(req->path, "/index.html");
+        if (stat(req->path, &st) == -1)
+            st.st_mode = 0;
+    }
+    trace_end("stat", t);
+    if (S_ISREG(st.st_mode)) {
+        t = trace_begin("realpath");
+        if (realpath(req->path, resolved) == NULL)
+            st.st_mode = 0;
+        trace_end("realpath", t);
     }
+    // 文件不存在或超出document_root目录，返回404错误
+    root_len = strlen(docroot_real);
+    if (!S_ISREG(st.st_mode) ||
+        strncmp(resolved, docroot_real, root_len) != 0 ||
+        (resolved[root_len] != '/' && resolved[root_len] != '\0')) {
+        not_found(conn->fd);
+        req->status = 404;
+        req->keep_alive = 0;
+        goto out;
+    }
+
+    // 如果文件有执行权限，认为是CGI脚本
+    if ((st.st_mode & S_IXUSR) ||
+        (st.st_mode & S_IXGRP) ||
+        (st.st_mode & S_IXOTH))
+        cgi = 1;
+
+    // 根据是否是CGI请求选择处理方式
+    if (!cgi)
+        serve_file(conn, req->path);
+    else
+        execute_cgi(conn, req->path);
 
+out:
     // 记录访问日志
-    struct sockaddr_in addr;
-    socklen_t addr_len = sizeof(addr);
-    getpeername(client, (struct sockaddr*)&addr, &addr_len);
-    
-    log_access("%s - \"%s %s\" %d", 
-               inet_ntoa(addr.sin_addr),
-               method,
-               url,
-               200); // 这里应该根据实际响应码修改
-               
-    close(client);
+    t = trace_begin("log_access");
+    inet_ntop(AF_INET, &conn->addr, addr_str, sizeof(addr_str));
+    log_access("%s - \"%s %s\" %d",
+               addr_str,
+               req->method ? req->method : "-",
+               req->url ? req->url : "-",
+               req->status);
+    trace_end("log_access", t);
+    trace_request_end(req);
+    return req->keep_alive;
 }
 /**********************************************************************/
 /* Inform the client that a request it has made has a problem.
@@ -267,15 +1856,40 @@ void bad_request(int client)
     char buf[1024];
 
     sprintf(buf, "HTTP/1.0 400 BAD REQUEST\r\n");
-    send(client, buf, sizeof(buf), 0);
+    send(client, buf, strlen(buf), 0);
     sprintf(buf, "Content-type: text/html\r\n");
-    send(client, buf, sizeof(buf), 0);
+    send(client, buf, strlen(buf), 0);
     sprintf(buf, "\r\n");
-    send(client, buf, sizeof(buf), 0);
+    send(client, buf, strlen(buf), 0);
     sprintf(buf, "<P>Your browser sent a bad request, ");
-    send(client, buf, sizeof(buf), 0);
+    send(client, buf, strlen(buf), 0);
     sprintf(buf, "such as a POST without a Content-Length.\r\n");
-    send(client, buf, sizeof(buf), 0);
+    send(client, buf, strlen(buf), 0);
+}
+
+/**********************************************************************/
+/* Inform the client that its request headers were too large to
+ * process.
+ * Parameters: client socket */
+/**********************************************************************/
+void header_too_large(int client)
+{
+    char buf[1024];
+
+    sprintf(buf, "HTTP/1.0 431 Request Header Fields Too Large\r\n");
+    send(client, buf, strlen(buf), 0);
+    sprintf(buf, SERVER_STRING);
+    send(client, buf, strlen(buf), 0);
+    sprintf(buf, "Content-Type: text/html\r\n");
+    send(client, buf, strlen(buf), 0);
+    sprintf(buf, "\r\n");
+    send(client, buf, strlen(buf), 0);
+    sprintf(buf, "<HTML><TITLE>Request Header Fields Too Large</TITLE>\r\n");
+    send(client, buf, strlen(buf), 0);
+    sprintf(buf, "<BODY><P>Your browser sent request headers that are too large.\r\n");
+    send(client, buf, strlen(buf), 0);
+    sprintf(buf, "</BODY></HTML>\r\n");
+    send(client, buf, strlen(buf), 0);
 }
 
 /**********************************************************************/
@@ -283,18 +1897,17 @@ void bad_request(int client)
  * is named after the UNIX "cat" command, because it might have been
  * easier just to do something like pipe, fork, and exec("cat").
  * Parameters: the client socket descriptor
- *             FILE pointer for the file to cat */
+ *             descriptor of the file to cat */
 /**********************************************************************/
-void cat(int client, FILE *resource)
+void cat(int client, int fd)
 {
-    char buf[1024];
+    char buf[4096];
+    ssize_t n;
 
-    fgets(buf, sizeof(buf), resource);
-    while (!feof(resource))
-    {
-        send(client, buf, strlen(buf), 0);
-        fgets(buf, sizeof(buf), resource);
-    }
+    // 按块读取，二进制文件中的'\0'也会原样发送
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        if (send(client, buf, n, 0) < 0)
+            break;
 }
 
 /**********************************************************************/
@@ -328,12 +1941,14 @@ void error_die(const char *sc)
 
 /**********************************************************************/
 /* Execute a CGI script.  Will need to set environment variables as
- * appropriate.
- * Parameters: client socket descriptor
+ * appropriate.  The script's response headers are parsed and a new
+ * HTTP/1.1 header is generated; the body is framed by Content-Length
+ * when the script gives one and by chunked encoding otherwise.
+ * Parameters: the client connection (method, query string and
+ *             request body framing come from its parsed request)
  *             path to the CGI script */
 /**********************************************************************/
-void execute_cgi(int client, const char *path,
-        const char *method, const char *query_string)
+void execute_cgi(struct connection *conn, const char *path)
 {
     /* CGI脚本执行流程：
      * 1. 创建两个管道用于父子进程通信
@@ -344,135 +1959,322 @@ void execute_cgi(int client, const char *path,
      *    - 执行CGI程序
      * 4. 在父进程中：
      *    - 如果是POST请求，将POST数据写入子进程
-     *    - 读取CGI程序的输出并发送给客户端
+     *    - 解析CGI程序输出的响应头，生成HTTP响应头
+     *    - 按Content-Length或分块编码转发响应体
      */
-    char buf[1024];
+    struct request *req = &conn->req;
+    int client = conn->fd;
+    char buf[CGI_BUF_SIZE];
+    char extra[CGI_HEADER_MAX];     // 原样转发的CGI响应头
+    char hdr[CGI_HEADER_MAX + 512];
+    char date_str[100];
     int cgi_output[2];
     int cgi_input[2];
     pid_t pid;
     int status;
-    int i;
-    char c;
-    int numchars = 1;
-    int content_length = -1;
-
-    buf[0] = 'A'; buf[1] = '\0';
-    if (strcasecmp(method, "GET") == 0)
-        while ((numchars > 0) && strcmp("\n", buf))  /* read & discard headers */
-            numchars = get_line(client, buf, sizeof(buf));
-    else if (strcasecmp(method, "POST") == 0) /*POST*/
-    {
-        numchars = get_line(client, buf, sizeof(buf));
-        while ((numchars > 0) && strcmp("\n", buf))
-        {
-            buf[15] = '\0';
-            if (strcasecmp(buf, "Content-Length:") == 0)
-                content_length = atoi(&(buf[16]));
-            numchars = get_line(client, buf, sizeof(buf));
-        }
-        if (content_length == -1) {
+    long remaining;
+    ssize_t n;
+    char *meth_env, *query_env, *length_env;
+    char *body = NULL;          // 解码后的分块请求体
+    char *line, *next, *value, *body_start;
+    size_t len, have, elen, hlen;
+    long cgi_length = -1;       // CGI给出的Content-Length
+    int code = 200, chunked, no_body;
+    const char *reason = NULL;
+    int location = 0;
+    uint64_t t;
+
+    // 只有POST的请求体会交给CGI，其他方法的请求体没有读取，不能复用连接
+    if (strcasecmp(req->method, "POST") != 0 &&
+        (req->content_length > 0 || req->chunked))
+        req->keep_alive = 0;
+
+    if (strcasecmp(req->method, "POST") == 0 && req->chunked) {
+        if (read_chunked_body(conn, &body, &req->content_length) == -1) {
             bad_request(client);
+            req->status = 400;
+            req->keep_alive = 0;
             return;
         }
     }
-    else/*HEAD or other*/
-    {
+    else if (strcasecmp(req->method, "POST") == 0 && req->content_length < 0) {
+        bad_request(client);
+        req->status = 400;
+        req->keep_alive = 0;
+        return;
     }
 
+    // 环境变量在fork之前从arena中分配，子进程中不再分配内存
+    len = strlen("REQUEST_METHOD=") + strlen(req->method) + 1;
+    if ((meth_env = arena_alloc(&conn->arena, len)) != NULL)
+        snprintf(meth_env, len, "REQUEST_METHOD=%s", req->method);
+    len = strlen("QUERY_STRING=") + (req->query_string ? strlen(req->query_string) : 0) + 1;
+    if ((query_env = arena_alloc(&conn->arena, len)) != NULL)
+        snprintf(query_env, len, "QUERY_STRING=%s",
+                 req->query_string ? req->query_string : "");
+    len = strlen("CONTENT_LENGTH=") + 21;
+    if ((length_env = arena_alloc(&conn->arena, len)) != NULL)
+        snprintf(length_env, len, "CONTENT_LENGTH=%ld", req->content_length);
+    if (meth_env == NULL || query_env == NULL || length_env == NULL) {
+        cannot_execute(client);
+        req->status = 500;
+        req->keep_alive = 0;
+        free(body);
+        return;
+    }
 
-    if (pipe(cgi_output) < 0) {
+    t = trace_begin("cgi_spawn");
+    // O_CLOEXEC防止其他线程同时fork出的子进程继承管道
+    if (pipe2(cgi_output, O_CLOEXEC) < 0) {
         cannot_execute(client);
+        req->status = 500;
+        req->keep_alive = 0;
+        free(body);
         return;
     }
-    if (pipe(cgi_input) < 0) {
+    if (pipe2(cgi_input, O_CLOEXEC) < 0) {
+        close(cgi_output[0]);
+        close(cgi_output[1]);
         cannot_execute(client);
+        req->status = 500;
+        req->keep_alive = 0;
+        free(body);
         return;
     }
 
     if ( (pid = fork()) < 0 ) {
+        close(cgi_output[0]);
+        close(cgi_output[1]);
+        close(cgi_input[0]);
+        close(cgi_input[1]);
         cannot_execute(client);
+        req->status = 500;
+        req->keep_alive = 0;
+        free(body);
         return;
     }
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    send(client, buf, strlen(buf), 0);
     if (pid == 0)  /* child: CGI script */
     {
-        char meth_env[255];
-        char query_env[255];
-        char length_env[255];
-
         dup2(cgi_output[1], STDOUT);
         dup2(cgi_input[0], STDIN);
         close(cgi_output[0]);
         close(cgi_input[1]);
-        sprintf(meth_env, "REQUEST_METHOD=%s", method);
         putenv(meth_env);
-        if (strcasecmp(method, "GET") == 0) {
-            sprintf(query_env, "QUERY_STRING=%s", query_string);
-            putenv(query_env);
-        }
-        else {   /* POST */
-            sprintf(length_env, "CONTENT_LENGTH=%d", content_length);
+        putenv(query_env);
+        if (strcasecmp(req->method, "POST") == 0)
             putenv(length_env);
-        }
-        execl(path, NULL);
+        execl(path, path, (char *)NULL);
         exit(0);
-    } else {    /* parent */
-        close(cgi_output[1]);
-        close(cgi_input[0]);
-        if (strcasecmp(method, "POST") == 0)
-            for (i = 0; i < content_length; i++) {
-                recv(client, &c, 1, 0);
-                write(cgi_input[1], &c, 1);
+    }
+
+    /* parent */
+    trace_end("cgi_spawn", t);
+    close(cgi_output[1]);
+    close(cgi_input[0]);
+    // 请求体可能有一部分已经在连接的读缓冲区中
+    t = trace_begin("cgi_body");
+    if (body != NULL) {
+        if (write(cgi_input[1], body, req->content_length) != req->content_length)
+            req->keep_alive = 0;
+        free(body);
+    }
+    else if (strcasecmp(req->method, "POST") == 0)
+        for (remaining = req->content_length; remaining > 0; remaining -= n) {
+            n = conn_read(conn, buf,
+                    remaining < (long)sizeof(buf) ? (size_t)remaining : sizeof(buf));
+            if (n <= 0 || write(cgi_input[1], buf, n) != n) {
+                req->keep_alive = 0;    // 请求体没有读完，连接不能复用
+                break;
             }
-        while (read(cgi_output[0], &c, 1) > 0)
-            send(client, &c, 1, 0);
+        }
+    // 关闭写端，让读到EOF才结束的CGI程序能够继续
+    close(cgi_input[1]);
+    trace_end("cgi_body", t);
 
-        close(cgi_output[0]);
-        close(cgi_input[1]);
-        waitpid(pid, &status, 0);
+    // 读取CGI的响应头，直到空行
+    t = trace_begin("cgi_output");
+    have = 0;
+    body_start = NULL;
+    while (have < CGI_HEADER_MAX && body_start == NULL) {
+        n = read(cgi_output[0], buf + have, CGI_HEADER_MAX - have);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        have += n;
+        body_start = cgi_header_end(buf, have);
+    }
+    if (body_start == NULL) {
+        // CGI没有输出完整的响应头
+        cannot_execute(client);
+        req->status = 500;
+        req->keep_alive = 0;
+        goto done;
+    }
+
+    // 解析响应头，Status/Content-Length/Location由服务器处理，其余原样转发
+    elen = 0;
+    for (line = buf; line < body_start; line = next) {
+        next = memchr(line, '\n', body_start - line);
+        next = next ? next + 1 : body_start;
+        len = next - line;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            len--;
+        line[len] = '\0';
+        if (len == 0 || (value = strchr(line, ':')) == NULL)
+            continue;
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t')
+            value++;
+        if (strcasecmp(line, "Status") == 0) {
+            code = atoi(value);
+            for (reason = value; *reason && *reason != ' '; reason++)
+                ;
+            while (*reason == ' ')
+                reason++;
+            if (*reason == '\0')
+                reason = NULL;
+        }
+        else if (strcasecmp(line, "Content-Length") == 0)
+            cgi_length = atol(value);
+        else if (strcasecmp(line, "Connection") == 0 ||
+                 strcasecmp(line, "Transfer-Encoding") == 0)
+            continue;   // 逐跳头部由服务器决定
+        else {
+            if (strcasecmp(line, "Location") == 0)
+                location = 1;
+            if (elen < sizeof(extra))
+                elen += snprintf(extra + elen, sizeof(extra) - elen,
+                                 "%s: %s\r\n", line, value);
+        }
+    }
+    if (location && code == 200)
+        code = 302;
+    if (code < 100 || code > 999)
+        code = 500;
+
+    // 选择响应体的分帧方式，1xx、204和304响应没有响应体，也不带分帧头部
+    no_body = code < 200 || code == 204 || code == 304;
+    chunked = 0;
+    if (!no_body && cgi_length < 0) {
+        if (strcasecmp(req->version, "HTTP/1.1") == 0)
+            chunked = 1;
+        else
+            req->keep_alive = 0;
+    }
+
+    if (elen >= sizeof(extra))
+        elen = sizeof(extra) - 1;
+
+    http_date(date_str, sizeof(date_str));
+    hlen = snprintf(hdr, sizeof(hdr),
+                    "HTTP/1.1 %d %s\r\n" SERVER_STRING DATE "%.*s",
+                    code, reason ? reason : status_reason(code), date_str,
+                    (int)elen, extra);
+    if (hlen > sizeof(hdr) - 128)
+        hlen = sizeof(hdr) - 128;
+    if (!no_body && cgi_length >= 0)
+        hlen += snprintf(hdr + hlen, sizeof(hdr) - hlen, CONTENT_LENGTH, (long long)cgi_length);
+    else if (chunked)
+        hlen += snprintf(hdr + hlen, sizeof(hdr) - hlen, "Transfer-Encoding: chunked\r\n");
+    hlen += snprintf(hdr + hlen, sizeof(hdr) - hlen, CONNECTION "\r\n",
+                     req->keep_alive ? "keep-alive" : "close");
+    req->status = code;
+
+    // 响应头和已经读到的第一段响应体一起发送
+    have -= body_start - buf;
+    if (no_body) {
+        struct iovec iov = { hdr, hlen };
+
+        // CGI之后的输出不再转发
+        if (writev_all(client, &iov, 1) == -1)
+            goto broken;
+    }
+    else if (chunked) {
+        if (send_chunk(client, hdr, hlen, body_start, have) == -1)
+            goto broken;
+        while ((n = read_coalesced(cgi_output[0], buf, sizeof(buf))) > 0)
+            if (send_chunk(client, NULL, 0, buf, n) == -1)
+                goto broken;
+        if (send(client, "0\r\n\r\n", 5, 0) != 5)
+            goto broken;
+    }
+    else {
+        struct iovec iov[2];
+
+        remaining = cgi_length >= 0 ? cgi_length : LONG_MAX;
+        if ((long)have > remaining)
+            have = remaining;
+        iov[0].iov_base = hdr;
+        iov[0].iov_len = hlen;
+        iov[1].iov_base = body_start;
+        iov[1].iov_len = have;
+        if (writev_all(client, iov, 2) == -1)
+            goto broken;
+        remaining -= have;
+        while (remaining > 0 &&
+               (n = read_coalesced(cgi_output[0], buf, sizeof(buf))) > 0) {
+            if (n > remaining)
+                n = remaining;
+            iov[0].iov_base = buf;
+            iov[0].iov_len = n;
+            if (writev_all(client, iov, 1) == -1)
+                goto broken;
+            remaining -= n;
+        }
+        // CGI输出比声明的Content-Length短，只能关闭连接
+        if (cgi_length >= 0 && remaining > 0)
+            req->keep_alive = 0;
     }
+    goto done;
+
+broken:
+    req->keep_alive = 0;
+done:
+    trace_end("cgi_output", t);
+    close(cgi_output[0]);
+    t = trace_begin("cgi_wait");
+    waitpid(pid, &status, 0);
+    trace_end("cgi_wait", t);
 }
 
 /**********************************************************************/
-/* Get a line from a socket, whether the line ends in a newline,
+/* Get a line from the connection, whether the line ends in a newline,
  * carriage return, or a CRLF combination.  Terminates the string read
  * with a null character.  If no newline indicator is found before the
  * end of the buffer, the string is terminated with a null.  If any of
  * the above three line terminators is read, the last character of the
  * string will be a linefeed and the string will be terminated with a
- * null character.
- * Parameters: the socket descriptor
+ * null character.  Bytes come from the connection's read buffer, which
+ * is refilled from the socket only when it runs empty.
+ * Parameters: the client connection
  *             the buffer to save the data in
  *             the size of the buffer
  * Returns: the number of bytes stored (excluding null) */
 /**********************************************************************/
-int get_line(int sock, char *buf, int size)
+int get_line(struct connection *conn, char *buf, int size)
 {
     int i = 0;
     char c = '\0';
-    int n;
 
     while ((i < size - 1) && (c != '\n'))
     {
-        n = recv(sock, &c, 1, 0);
-        /* DEBUG printf("%02X\n", c); */
-        if (n > 0)
+        if (conn->rpos < conn->rlen || conn_fill(conn))
         {
+            c = conn->rbuf[conn->rpos++];
             if (c == '\r')
             {
-                n = recv(sock, &c, 1, MSG_PEEK);
-                /* DEBUG printf("%02X\n", c); */
-                if ((n > 0) && (c == '\n'))
-                    recv(sock, &c, 1, 0);
-                else
-                    c = '\n';
+                // 查看下一个字节是否是'\n'，是则一并消费
+                if ((conn->rpos < conn->rlen || conn_fill(conn)) &&
+                    conn->rbuf[conn->rpos] == '\n')
+                    conn->rpos++;
+                c = '\n';
             }
             buf[i] = c;
             i++;
         }
         else
-            c = '\n';
+            break;
     }
     buf[i] = '\0';
 
@@ -482,52 +2284,48 @@ int get_line(int sock, char *buf, int size)
 /**********************************************************************/
 /* Return the informational HTTP headers about a file. */
 /* Parameters: the socket to print the headers on
- *             the name of the file */
+ *             the name of the file
+ *             the length of the body that follows
+ *             the Content-Encoding of the body, NULL if not encoded
+ *             whether the connection stays open afterwards */
 /**********************************************************************/
-void headers(int client, const char *filename)
+void headers(int client, const char *filename, off_t length,
+        const char *encoding, int keep_alive)
 {
     char buf[1024];
     char date_str[100];
-    time_t now = time(0);
-    struct tm tm = *gmtime(&now);
     const char *content_type;
-    struct stat st;
-    
-    // 获取文件大小
-    if (stat(filename, &st) == -1)
-        return;
-        
+    int n;
+
     // 根据文件扩展名确定Content-Type
     content_type = get_content_type(filename);
     
     // 格式化HTTP日期
-    strftime(date_str, sizeof(date_str), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    http_date(date_str, sizeof(date_str));
     
-    // 发送基本响应头
-    sprintf(buf, "HTTP/1.1 200 OK\r\n");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, SERVER_STRING);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, DATE, date_str);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, CONTENT_TYPE, content_type);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, CONTENT_LENGTH, (int)st.st_size);
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, CONNECTION, "close");
-    send(client, buf, strlen(buf), 0);
-    sprintf(buf, "\r\n");
-    send(client, buf, strlen(buf), 0);
+    // 整个响应头拼好后一次send()，而不是每行一个系统调用
+    n = sprintf(buf, "HTTP/1.1 200 OK\r\n");
+    n += sprintf(buf + n, SERVER_STRING);
+    n += sprintf(buf + n, DATE, date_str);
+    n += sprintf(buf + n, CONTENT_TYPE, content_type);
+    n += sprintf(buf + n, CONTENT_LENGTH, (long long)length);
+    n += sprintf(buf + n, CONNECTION, keep_alive ? "keep-alive" : "close");
+    // 可能按Accept-Encoding返回不同内容的资源需要告知缓存
+    if (encoding != NULL || compressible_type(content_type))
+        n += sprintf(buf + n, "Vary: Accept-Encoding\r\n");
+    if (encoding != NULL)
+        n += sprintf(buf + n, "Content-Encoding: %s\r\n", encoding);
 
-    // 对静态资源添加缓存控制
+    // 对静态资源添加缓存控制（必须在空行之前，否则会被当作响应体）
     if (strstr(filename, ".html") || strstr(filename, ".htm")) {
         // HTML文件不缓存
-        sprintf(buf, "Cache-Control: no-cache\r\n");
+        n += sprintf(buf + n, "Cache-Control: no-cache\r\n");
     } else {
         // 其他静态资源缓存1小时
-        sprintf(buf, "Cache-Control: public, max-age=3600\r\n");
+        n += sprintf(buf + n, "Cache-Control: public, max-age=3600\r\n");
     }
-    send(client, buf, strlen(buf), 0);
+    n += sprintf(buf + n, "\r\n");
+    send(client, buf, n, 0);
 }
 
 /**********************************************************************/
@@ -557,32 +2355,107 @@ void not_found(int client)
     send(client, buf, strlen(buf), 0);
 }
 
+/**********************************************************************/
+/* Reject a connection while overloaded.  The response is built once by
+ * admission_init(), so shedding costs a single send().
+ * Parameter: the client socket */
+/**********************************************************************/
+void service_unavailable(int client)
+{
+    char drain[1024];
+
+    // 读掉已到达的请求数据，避免close()时内核回RST导致客户端收不到503
+    recv(client, drain, sizeof(drain), MSG_DONTWAIT);
+    send(client, unavailable_response, unavailable_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
 /**********************************************************************/
 /* Send a regular file to the client.  Use headers, and report
- * errors to client if they occur.
- * Parameters: a pointer to a file structure produced from the socket
- *              file descriptor
+ * errors to client if they occur.  When the client accepts it, a
+ * precompressed .br/.gz file next to the original is sent instead,
+ * or a gzip version is produced on the fly and cached.
+ * Parameters: the client connection (its request is already parsed)
  *             the name of the file to serve */
 /**********************************************************************/
-void serve_file(int client, const char *filename)
+void serve_file(struct connection *conn, const char *filename)
 {
-    FILE *resource = NULL;
-    int numchars = 1;
-    char buf[1024];
+    struct request *req = &conn->req;
+    int resource;
+    int side = -1;
+    struct stat st, side_st;
+    struct gzip_entry *gz = NULL;
+    const char *encoding = NULL;
+    uint64_t t;
 
-    buf[0] = 'A'; buf[1] = '\0';
-    while ((numchars > 0) && strcmp("\n", buf))  /* read & discard headers */
-        numchars = get_line(client, buf, sizeof(buf));
+    // 未读取的请求体会被当成下一个请求，因此这种情况下不保持连接
+    if (req->content_length > 0 || req->chunked)
+        req->keep_alive = 0;
 
-    resource = fopen(filename, "r");
-    if (resource == NULL)
-        not_found(client);
-    else
+    // 直接使用文件描述符，不经过stdio，请求路径上不分配内存
+    t = trace_begin("open");
+    resource = open(filename, O_RDONLY | O_CLOEXEC);
+    trace_end("open", t);
+    if (resource == -1 || fstat(resource, &st) == -1)
+    {
+        not_found(conn->fd);
+        req->status = 404;
+        req->keep_alive = 0;
+        if (resource != -1)
+            close(resource);
+        return;
+    }
+
+    /* 内容协商：
+     * 1. 优先使用文件旁边的.br/.gz预压缩文件
+     * 2. 可压缩的类型在线压缩成gzip，结果放入缓存
+     * 3. 否则发送原始文件
+     */
+    if (accepts_encoding(req, "br") &&
+        (side = open_sidecar(conn, filename, ".br", &st, &side_st)) != -1)
+        encoding = "br";
+    else if (accepts_encoding(req, "gzip") &&
+        (side = open_sidecar(conn, filename, ".gz", &st, &side_st)) != -1)
+        encoding = "gzip";
+    else if (config.gzip_cache_size > 0 && st.st_size <= config.gzip_max_size &&
+             compressible_type(get_content_type(filename)) &&
+             accepts_encoding(req, "gzip"))
     {
-        headers(client, filename);
-        cat(client, resource);
+        gz = gzip_cache_get(filename, &st, resource);
+        if (gz != NULL && gz->data == NULL) {
+            gzip_cache_release(gz);     // 压缩后没有变小，发送原文件
+            gz = NULL;
+        }
+        if (gz != NULL)
+            encoding = "gzip";
+    }
+    if (side != -1) {
+        close(resource);
+        resource = side;
+        st = side_st;
     }
-    fclose(resource);
+
+    socket_cork(conn->fd, 1);
+    t = trace_begin("headers");
+    headers(conn->fd, filename, gz ? (off_t)gz->len : st.st_size, encoding,
+            req->keep_alive);
+    trace_end("headers", t);
+    t = trace_begin("cat");
+    if (gz != NULL) {
+        struct iovec iov = { gz->data, gz->len };
+        if (writev_all(conn->fd, &iov, 1) == -1)
+            req->keep_alive = 0;
+        gzip_cache_release(gz);
+    }
+    else if (st.st_size >= config.large_file_size) {
+        if (send_large_file(conn->fd, resource, &st) == -1)
+            req->keep_alive = 0;
+    }
+    else
+        cat(conn->fd, resource);
+    trace_end("cat", t);
+    socket_cork(conn->fd, 0);
+    req->status = 200;
+    close(resource);
 }
 
 /**********************************************************************/
@@ -597,7 +2470,7 @@ int startup(u_short *port)
 {
     /* 服务器启动流程：
      * 1. 创建服务器套接字
-     * 2. 设置套接字选项（地址重用）
+     * 2. 设置套接字选项（地址重用、延迟accept、TCP Fast Open）
      * 3. 绑定到指定端口（如果端口为0则动态分配）
      * 4. 开始监听连接
      * 返回：服务器套接字描述符
@@ -606,7 +2479,8 @@ int startup(u_short *port)
     int on = 1;
     struct sockaddr_in name;
 
-    httpd = socket(PF_INET, SOCK_STREAM, 0);
+    // 监听套接字和accept4()得到的连接都不能泄漏给CGI子进程
+    httpd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (httpd == -1)
         error_die("socket");
     memset(&name, 0, sizeof(name));
@@ -626,7 +2500,17 @@ int startup(u_short *port)
             error_die("getsockname");
         *port = ntohs(name.sin_port);
     }
-    if (listen(httpd, 5) < 0)
+    // 请求数据到达之前不唤醒accept()，只建立了连接的客户端不占用线程
+    if (config.tcp_defer_accept > 0 &&
+        setsockopt(httpd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &config.tcp_defer_accept,
+                   sizeof(config.tcp_defer_accept)) < 0)
+        perror("setsockopt TCP_DEFER_ACCEPT");
+    // 回头客可以在SYN中携带请求，省掉一个RTT（需内核net.ipv4.tcp_fastopen开启服务端）
+    if (config.tcp_fastopen > 0 &&
+        setsockopt(httpd, IPPROTO_TCP, TCP_FASTOPEN, &config.tcp_fastopen,
+                   sizeof(config.tcp_fastopen)) < 0)
+        perror("setsockopt TCP_FASTOPEN");
+    if (listen(httpd, config.listen_backlog > 0 ? config.listen_backlog : 5) < 0)
         error_die("listen");
     return(httpd);
 }
@@ -671,14 +2555,28 @@ int main(void)
      * 3. 服务器永久运行，除非发生错误或被手动终止
      */
     int server_sock = -1;
-    u_short port = 4000;
+    u_short port;
     int client_sock = -1;
     struct sockaddr_in client_name;
     socklen_t  client_name_len = sizeof(client_name);
     pthread_t newthread;
+    struct connection *conn;
+    struct ip_slot *slot;
 
     /* 主函数：启动服务器并处理客户端连接 */
 
+    config = read_config("httpd.conf");
+    port = config.port;
+    fd_limit_init();
+    admission_init();
+    log_init();
+    trace_init();
+    bundle_init();
+    if (realpath(config.document_root, docroot_real) == NULL)
+        error_die("document_root");
+    // 客户端提前断开时send()不应该杀死整个进程
+    signal(SIGPIPE, SIG_IGN);
+
     // 初始化服务器，监听指定端口
     server_sock = startup(&port);
     printf("httpd running on port %d\n", port);
@@ -689,16 +2587,63 @@ int main(void)
      */
     while (1)
     {
-        client_sock = accept(server_sock,
+        uint64_t now;
+
+        client_name_len = sizeof(client_name);
+        /* 工作线程使用阻塞I/O加超时，因此这里只要SOCK_CLOEXEC，
+         * 不设置SOCK_NONBLOCK */
+        client_sock = accept4(server_sock,
                 (struct sockaddr *)&client_name,
-                &client_name_len);
-        if (client_sock == -1)
+                &client_name_len, SOCK_CLOEXEC);
+        if (client_sock == -1) {
+            // 客户端在accept前已断开之类的暂时性错误不应导致服务器退出
+            if (errno == EINTR || errno == ECONNABORTED || errno == EPROTO)
+                continue;
+            // 描述符或内存耗尽时短暂退避，等已有连接结束后释放资源
+            if (errno == EMFILE || errno == ENFILE ||
+                errno == ENOBUFS || errno == ENOMEM) {
+                perror("accept");
+                usleep(10000);
+                continue;
+            }
             error_die("accept");
-        
+        }
+        now = monotonic_us();
+
+        // 在accept队列中排队过久说明服务器已经过载，不创建线程直接回503
+        if (codel_should_drop(accept_queue_delay_us(client_sock), now)) {
+            service_unavailable(client_sock);
+            close(client_sock);
+            continue;
+        }
+
+        // 超出并发或速率限制的连接直接回503，不创建线程
+        if (!admission_acquire(client_name.sin_addr.s_addr, now, &slot)) {
+            service_unavailable(client_sock);
+            close(client_sock);
+            continue;
+        }
+
+        conn = conn_get();
+        if (conn == NULL) {
+            service_unavailable(client_sock);
+            close(client_sock);
+            admission_release(slot);
+            continue;
+        }
+        conn->fd = client_sock;
+        conn->addr = client_name.sin_addr.s_addr;
+        conn->ip_slot = slot;
+
         // 创建新线程处理请求
         if (pthread_create(&newthread, NULL, (void *)accept_request, 
-                (void *)(intptr_t)client_sock) != 0)
+                (void *)conn) != 0) {
             perror("pthread_create");
+            service_unavailable(client_sock);
+            close(client_sock);
+            admission_release(conn->ip_slot);
+            conn_put(conn);
+        }
     }
 
     close(server_sock);
@@ -726,31 +2671,47 @@ const char* get_content_type(const char *filename)
         return "text/css";
     if (strcasecmp(dot, ".js") == 0)
         return "application/javascript";
+    if (strcasecmp(dot, ".json") == 0)
+        return "application/json";
+    if (strcasecmp(dot, ".svg") == 0)
+        return "image/svg+xml";
     if (strcasecmp(dot, ".pdf") == 0)
         return "application/pdf";
         
     return "text/plain";
 }
 
+// 访问日志在启动时打开一次，之后所有线程共用
+static int access_log_fd = -1;
+
+void log_init(void)
+{
+    access_log_fd = open("access.log", O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (access_log_fd == -1)
+        perror("access.log");
+}
+
 // 添加日志函数
 void log_access(const char *format, ...) 
 {
-    FILE *fp;
     va_list arg_list;
-    char timestamp[100];
+    char line[1024];
+    struct tm tm;
     time_t now = time(NULL);
+    int n;
     
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", 
-             localtime(&now));
-    
-    fp = fopen("access.log", "a");
-    if (fp == NULL) return;
-    
-    fprintf(fp, "[%s] ", timestamp);
+    if (access_log_fd == -1) return;
+
+    n = strftime(line, sizeof(line), "[%Y-%m-%d %H:%M:%S] ", 
+                 localtime_r(&now, &tm));
     va_start(arg_list, format);
-    vfprintf(fp, format, arg_list);
+    n += vsnprintf(line + n, sizeof(line) - n - 1, format, arg_list);
     va_end(arg_list);
-    fprintf(fp, "\n");
+    if (n > (int)sizeof(line) - 2)
+        n = sizeof(line) - 2;   // 过长的URL被截断
+    line[n++] = '\n';
     
-    fclose(fp);
+    // O_APPEND下每行一次write()，多个线程的日志不会交错
+    if (write(access_log_fd, line, n) < 0)
+        return;
 }